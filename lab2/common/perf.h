@@ -0,0 +1,180 @@
+#ifndef PERF_H
+#define PERF_H
+
+// Hardware counters of the calling process around one phase of work, via perf_event_open.
+// Every counter is opened on its own, so one the kernel or the hardware does not allow
+// only leaves its column empty (-1) instead of failing the whole measurement.
+
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+enum { PERF_CYCLES, PERF_INSTRUCTIONS, PERF_BRANCH_MISSES, PERF_L1D_MISSES, PERF_LLC_MISSES, PERF_CSWITCHES,
+       PERF_COUNTERS };
+
+static const char *perf_names[PERF_COUNTERS] = { "Cycles", "Instrs", "Br misses", "L1D misses", "LLC misses",
+                                                  "Ctx sw" };
+
+typedef struct {
+    long long value[PERF_COUNTERS]; // -1 if the counter could not be opened
+    long long bytes;                // processed while counting, for bytes per cycle
+} perf_sample_t;
+
+typedef struct {
+    int fd[PERF_COUNTERS];
+} perf_group_t;
+
+static inline void perf_attr(int counter, struct perf_event_attr *attr)
+{
+    memset(attr, 0, sizeof(struct perf_event_attr));
+    attr->size = sizeof(struct perf_event_attr);
+    attr->type = PERF_TYPE_HARDWARE;
+    switch (counter)
+    {
+        case PERF_CYCLES:
+            attr->config = PERF_COUNT_HW_CPU_CYCLES;
+            break;
+        case PERF_INSTRUCTIONS:
+            attr->config = PERF_COUNT_HW_INSTRUCTIONS;
+            break;
+        case PERF_BRANCH_MISSES:
+            attr->config = PERF_COUNT_HW_BRANCH_MISSES;
+            break;
+        case PERF_L1D_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_LLC_MISSES:
+            attr->type = PERF_TYPE_HW_CACHE;
+            attr->config = PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                           (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+            break;
+        case PERF_CSWITCHES:
+            attr->type = PERF_TYPE_SOFTWARE;
+            attr->config = PERF_COUNT_SW_CONTEXT_SWITCHES;
+            break;
+    }
+    attr->disabled = 1;
+    // User space only, which is all an unprivileged process may count under the default paranoia level
+    attr->exclude_kernel = 1;
+    attr->exclude_hv = 1;
+    attr->read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+}
+
+// Opens every counter it is allowed to for the calling process; returns how many it opened
+static inline int perf_open(perf_group_t *g)
+{
+    int opened = 0;
+    for (int k = 0; k < PERF_COUNTERS; k++)
+    {
+        struct perf_event_attr attr;
+        perf_attr(k, &attr);
+        if (k == PERF_CSWITCHES)
+            attr.exclude_kernel = 0; // Switches happen in the kernel, so they are only seen when it is counted
+        g->fd[k] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        if (g->fd[k] == -1 && k == PERF_CSWITCHES)
+        {
+            attr.exclude_kernel = 1;
+            g->fd[k] = syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (g->fd[k] != -1)
+            opened++;
+    }
+    return opened;
+}
+
+static inline void perf_start(perf_group_t *g)
+{
+    for (int k = 0; k < PERF_COUNTERS; k++)
+    {
+        if (g->fd[k] == -1)
+            continue;
+        ioctl(g->fd[k], PERF_EVENT_IOC_RESET, 0);
+        ioctl(g->fd[k], PERF_EVENT_IOC_ENABLE, 0);
+    }
+}
+
+// Stops counting and stores the counts, scaled up when the kernel multiplexed a counter
+static inline void perf_stop(perf_group_t *g, perf_sample_t *s)
+{
+    for (int k = 0; k < PERF_COUNTERS; k++)
+    {
+        s->value[k] = -1;
+        if (g->fd[k] == -1)
+            continue;
+        ioctl(g->fd[k], PERF_EVENT_IOC_DISABLE, 0);
+        unsigned long long data[3]; // value, time enabled, time running
+        if (read(g->fd[k], data, sizeof(data)) != sizeof(data))
+            continue;
+        if (data[2] == 0)
+            s->value[k] = 0;
+        else if (data[2] < data[1])
+            s->value[k] = (long long)((double)data[0] * data[1] / data[2]);
+        else
+            s->value[k] = data[0];
+    }
+}
+
+static inline void perf_close(perf_group_t *g)
+{
+    for (int k = 0; k < PERF_COUNTERS; k++)
+    {
+        if (g->fd[k] != -1)
+            close(g->fd[k]);
+        g->fd[k] = -1;
+    }
+}
+
+static inline void perf_print_row(FILE *out, const char *label, const perf_sample_t *s)
+{
+    fprintf(out, "%5s | %8lld", label, s->bytes);
+    for (int k = 0; k < PERF_COUNTERS; k++)
+    {
+        if (s->value[k] < 0)
+            fprintf(out, " | %10s", "n/a");
+        else
+            fprintf(out, " | %10lld", s->value[k]);
+    }
+    long long cycles = s->value[PERF_CYCLES], instructions = s->value[PERF_INSTRUCTIONS];
+    if (cycles > 0 && instructions >= 0)
+        fprintf(out, " | %5.2f", (double)instructions / cycles);
+    else
+        fprintf(out, " | %5s", "n/a");
+    if (cycles > 0)
+        fprintf(out, " | %11.4f\n", (double)s->bytes / cycles);
+    else
+        fprintf(out, " | %11s\n", "n/a");
+}
+
+// Prints the counts of every worker and their sum; a counter missing in any worker is missing in the sum
+static inline void perf_print(FILE *out, const perf_sample_t *samples, int count)
+{
+    fprintf(out, "%5s | %8s", "Child", "Bytes");
+    for (int k = 0; k < PERF_COUNTERS; k++)
+        fprintf(out, " | %10s", perf_names[k]);
+    fprintf(out, " | %5s | %11s\n", "IPC", "Bytes/cycle");
+    perf_sample_t total;
+    memset(&total, 0, sizeof(total));
+    char label[16];
+    for (int i = 0; i < count; i++)
+    {
+        snprintf(label, sizeof(label), "%d", i);
+        perf_print_row(out, label, &samples[i]);
+        total.bytes += samples[i].bytes;
+        for (int k = 0; k < PERF_COUNTERS; k++)
+        {
+            if (total.value[k] >= 0)
+                total.value[k] = samples[i].value[k] < 0 ? -1 : total.value[k] + samples[i].value[k];
+        }
+    }
+    perf_print_row(out, "Total", &total);
+    if (total.value[PERF_CYCLES] < 0)
+        fprintf(out, "Hardware counters are not available: no PMU, or not permitted by kernel.perf_event_paranoid\n");
+}
+
+#endif
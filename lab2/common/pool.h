@@ -0,0 +1,296 @@
+#ifndef POOL_H
+#define POOL_H
+
+// Process pool: every child is tracked by a pidfd watched in one epoll instance, so exits are
+// reaped with waitid(P_PIDFD) one child at a time, without SIGCHLD handlers and without racing
+// against PID reuse. Functions return -1 and set errno on failure, like the calls they wrap.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+#ifndef P_PIDFD
+#define P_PIDFD 3
+#endif
+
+#define POOL_EVENTS 64
+
+typedef struct pool pool_t;
+
+typedef struct {
+    pid_t pid;
+    int pidfd;           // -1 once the child is reaped
+    int status;          // wait status for the W* macros, valid once reaped
+    struct rusage usage; // resources used by the child, valid once reaped
+} pool_child_t;
+
+struct pool {
+    int epfd;
+    pool_child_t *children; // in creation order
+    int count, capacity;
+    int alive;
+    void (*on_exit)(pool_t *pool, int index); // called for every reaped child if set
+};
+
+static inline int pool_init(pool_t *pool, int capacity)
+{
+    memset(pool, 0, sizeof(pool_t));
+    // A live child holds a descriptor, so let the pool use every descriptor it may
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max)
+    {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    pool->capacity = capacity > 0 ? capacity : 16;
+    pool->children = malloc(pool->capacity * sizeof(pool_child_t));
+    if (pool->children == NULL)
+        return -1;
+    pool->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (pool->epfd == -1)
+    {
+        free(pool->children);
+        return -1;
+    }
+    return 0;
+}
+
+// Starts tracking pid, which must be a child of the calling process, at index pool->count;
+// pidfd is its pidfd if the caller already has one (clone3 with CLONE_PIDFD), -1 to open it here.
+// Opening it is race-free since nothing else reaps the child.
+static inline int pool_add(pool_t *pool, pid_t pid, int pidfd)
+{
+    if (pool->count == pool->capacity)
+    {
+        pool_child_t *grown = realloc(pool->children, 2 * pool->capacity * sizeof(pool_child_t));
+        if (grown == NULL)
+            return -1;
+        pool->children = grown;
+        pool->capacity *= 2;
+    }
+    int fd = pidfd != -1 ? pidfd : syscall(SYS_pidfd_open, pid, 0);
+    struct epoll_event ev;
+    ev.events = EPOLLIN; // A pidfd becomes readable when its process exits
+    ev.data.u32 = pool->count;
+    if (fd == -1 || epoll_ctl(pool->epfd, EPOLL_CTL_ADD, fd, &ev) == -1)
+    {
+        int saved = errno;
+        if (fd != -1)
+            close(fd);
+        errno = saved;
+        return -1;
+    }
+    pool_child_t *c = &pool->children[pool->count++];
+    memset(c, 0, sizeof(pool_child_t));
+    c->pid = pid;
+    c->pidfd = fd;
+    pool->alive++;
+    return 0;
+}
+
+// Drops the pool in a child that inherited it: the child reaps none of its siblings, and keeping
+// their pidfds and the epoll instance open would make every child hold a copy of them all.
+// The pool is left empty, so pool_free and pool_init may still be used on it.
+static inline void pool_forget(pool_t *pool)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (pool->children[i].pidfd != -1)
+            close(pool->children[i].pidfd);
+    }
+    close(pool->epfd);
+    free(pool->children);
+    memset(pool, 0, sizeof(pool_t));
+    pool->epfd = -1;
+}
+
+// Like fork(); in the parent the child is added at index pool->count - 1, the child gets the
+// pool forgotten. Plain fork is used instead of clone3 so glibc keeps its per-process state
+// (atfork handlers, the thread id raise() uses) consistent in the child.
+static inline pid_t pool_fork(pool_t *pool)
+{
+    long long start = trace_now();
+    pid_t pid = fork();
+    if (pid == 0)
+        pool_forget(pool);
+    if (pid <= 0)
+        return pid;
+    if (pool_add(pool, pid, -1) == -1)
+    {
+        int saved = errno;
+        kill(pid, SIGKILL);
+        waitpid(pid, NULL, 0);
+        errno = saved;
+        return -1;
+    }
+    trace_span("fork", start, "child", pid, "index", pool->count - 1);
+    return pid;
+}
+
+// Reaps child index if it has exited (blocks until then unless options has WNOHANG);
+// returns 1 if it is reaped, 0 if it is still running
+static inline int pool_reap_child(pool_t *pool, int index, int options)
+{
+    pool_child_t *c = &pool->children[index];
+    if (c->pidfd == -1)
+        return 1;
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    // The raw system call also fills in the child's rusage, which glibc's waitid() does not expose
+    if (syscall(SYS_waitid, P_PIDFD, c->pidfd, &info, WEXITED | options, &c->usage) == -1)
+        return -1;
+    if (info.si_pid == 0)
+        return 0;
+    if (info.si_code == CLD_EXITED)
+        c->status = W_EXITCODE(info.si_status, 0);
+    else
+        c->status = info.si_status | (info.si_code == CLD_DUMPED ? WCOREFLAG : 0);
+    epoll_ctl(pool->epfd, EPOLL_CTL_DEL, c->pidfd, NULL);
+    close(c->pidfd);
+    c->pidfd = -1;
+    pool->alive--;
+    trace_instant("reap", "pid", c->pid, "status", c->status);
+    if (pool->on_exit != NULL)
+        pool->on_exit(pool, index);
+    return 1;
+}
+
+// Waits up to timeout_ms (-1: no limit) for exits with sigmask in place if it is not NULL,
+// like epoll_pwait; returns how many children were reaped
+static inline int pool_reap(pool_t *pool, int timeout_ms, const sigset_t *sigmask)
+{
+    struct epoll_event events[POOL_EVENTS];
+    int n = epoll_pwait(pool->epfd, events, POOL_EVENTS, timeout_ms, sigmask);
+    if (n == -1)
+        return -1;
+    int reaped = 0;
+    for (int k = 0; k < n; k++)
+    {
+        int r = pool_reap_child(pool, events[k].data.u32, WNOHANG);
+        if (r == -1)
+            return -1;
+        reaped += r;
+    }
+    return reaped;
+}
+
+static inline int pool_wait_all(pool_t *pool)
+{
+    while (pool->alive > 0)
+    {
+        if (pool_reap(pool, -1, NULL) == -1 && errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+static inline double pool_ms(struct timeval tv)
+{
+    return tv.tv_sec * 1000.0 + tv.tv_usec / 1000.0;
+}
+
+static inline void pool_format_status(const pool_child_t *c, char *buf, size_t size)
+{
+    if (c->pidfd != -1)
+        snprintf(buf, size, "running");
+    else if (WIFEXITED(c->status))
+        snprintf(buf, size, "exit %d", WEXITSTATUS(c->status));
+    else
+        snprintf(buf, size, "signal %d", WTERMSIG(c->status));
+}
+
+// Sums the usage of rows, except the peak RSS which is the largest one
+static inline void pool_usage_total(const pool_child_t *rows, int count, struct rusage *total)
+{
+    memset(total, 0, sizeof(struct rusage));
+    for (int i = 0; i < count; i++)
+    {
+        const struct rusage *u = &rows[i].usage;
+        timeradd(&total->ru_utime, &u->ru_utime, &total->ru_utime);
+        timeradd(&total->ru_stime, &u->ru_stime, &total->ru_stime);
+        if (u->ru_maxrss > total->ru_maxrss)
+            total->ru_maxrss = u->ru_maxrss;
+        total->ru_nvcsw += u->ru_nvcsw;
+        total->ru_nivcsw += u->ru_nivcsw;
+        total->ru_inblock += u->ru_inblock;
+        total->ru_oublock += u->ru_oublock;
+    }
+}
+
+// Prints what each child cost (at most max_rows of them) and the totals
+static inline void pool_print_usage(FILE *out, const pool_child_t *rows, int count, int max_rows)
+{
+    char status[32];
+    fprintf(out, "Child |    PID | Status    |  User ms |   Sys ms | Max RSS KB | Vol cs | Invol cs "
+                 "|  Blk in | Blk out\n");
+    for (int i = 0; i < count && i < max_rows; i++)
+    {
+        const struct rusage *u = &rows[i].usage;
+        pool_format_status(&rows[i], status, sizeof(status));
+        fprintf(out, "%5d | %6d | %-9s | %8.1f | %8.1f | %10ld | %6ld | %8ld | %7ld | %7ld\n", i, rows[i].pid, status,
+                pool_ms(u->ru_utime), pool_ms(u->ru_stime), u->ru_maxrss, u->ru_nvcsw, u->ru_nivcsw, u->ru_inblock,
+                u->ru_oublock);
+    }
+    if (count > max_rows)
+        fprintf(out, "... %d more children\n", count - max_rows);
+    struct rusage t;
+    pool_usage_total(rows, count, &t);
+    fprintf(out, "Total | %6d | children  | %8.1f | %8.1f | %10ld | %6ld | %8ld | %7ld | %7ld\n", count,
+            pool_ms(t.ru_utime), pool_ms(t.ru_stime), t.ru_maxrss, t.ru_nvcsw, t.ru_nivcsw, t.ru_inblock, t.ru_oublock);
+}
+
+static inline void pool_write_usage_entry(FILE *out, const struct rusage *u)
+{
+    fprintf(out,
+            "\"user_ms\": %.3f, \"sys_ms\": %.3f, \"max_rss_kb\": %ld, \"voluntary_cs\": %ld, "
+            "\"involuntary_cs\": %ld, \"blocks_in\": %ld, \"blocks_out\": %ld",
+            pool_ms(u->ru_utime), pool_ms(u->ru_stime), u->ru_maxrss, u->ru_nvcsw, u->ru_nivcsw, u->ru_inblock,
+            u->ru_oublock);
+}
+
+// Writes the same data as pool_print_usage as JSON to path, for every child
+static inline int pool_write_usage_json(const char *path, const pool_child_t *rows, int count)
+{
+    FILE *out = fopen(path, "w");
+    if (out == NULL)
+        return -1;
+    char status[32];
+    fprintf(out, "{\"children\": [\n");
+    for (int i = 0; i < count; i++)
+    {
+        pool_format_status(&rows[i], status, sizeof(status));
+        fprintf(out, "  {\"child\": %d, \"pid\": %d, \"status\": \"%s\", ", i, rows[i].pid, status);
+        pool_write_usage_entry(out, &rows[i].usage);
+        fprintf(out, "}%s\n", i + 1 < count ? "," : "");
+    }
+    struct rusage t;
+    pool_usage_total(rows, count, &t);
+    fprintf(out, "], \"total\": {\"children\": %d, ", count);
+    pool_write_usage_entry(out, &t);
+    fprintf(out, "}}\n");
+    return fclose(out);
+}
+
+static inline void pool_free(pool_t *pool)
+{
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (pool->children[i].pidfd != -1)
+            close(pool->children[i].pidfd);
+    }
+    if (pool->epfd != -1)
+        close(pool->epfd);
+    free(pool->children);
+}
+
+#endif
@@ -0,0 +1,309 @@
+#ifndef RLOG_H
+#define RLOG_H
+
+// Ring-buffer logger: processes log fixed-size binary records into rings in one shared mapping,
+// and a collector process drains them in batches, orders them by time and formats them onto stdout.
+// Logging only takes atomic stores and clock_gettime, so it is safe in signal handlers and never
+// waits for the stdout lock. Functions return -1 and set errno on failure, like the calls they wrap.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RLOG_INFO 1  // lifecycle messages
+#define RLOG_DEBUG 2 // hot-path messages, subject to sampling
+#define RLOG_ARGS 4
+#define RLOG_RING_SIZE 4096 // records per ring, a power of two
+#define RLOG_MAX_RINGS 64   // processes beyond that share rings
+#define RLOG_BATCH 4096     // records the collector sorts and formats at once
+#define RLOG_IDLE_MS 5      // collector sleep when every ring is empty
+
+// Logs a message at level; fmt is a printf format taking up to RLOG_ARGS longs (%ld).
+// The format is only formatted by the collector, so it must be a string literal,
+// which the collector shares with every process it forked from.
+#define RLOG(level, fmt, ...) rlog_write(level, fmt, (long[RLOG_ARGS]){ __VA_ARGS__ })
+
+typedef struct {
+    unsigned long seq; // position + 1 once written, position + RLOG_RING_SIZE once drained
+    long long ts_ns;
+    const char *fmt;
+    long args[RLOG_ARGS];
+    pid_t pid;
+    int level;
+} rlog_record_t; // one cache line
+
+// Bounded multi-producer queue: a process and its signal handlers, or several processes once
+// they share a ring, reserve positions by moving head and publish each record through its seq
+typedef struct {
+    unsigned long head __attribute__((aligned(64))); // next position to reserve
+    unsigned long dropped;                           // records lost because the ring was full
+    unsigned long tail __attribute__((aligned(64))); // next position to drain, collector only
+    rlog_record_t cells[RLOG_RING_SIZE];
+} rlog_ring_t;
+
+typedef struct {
+    int stop;       // set by rlog_close, the collector drains what is left and exits
+    int next_ring;  // handed out by rlog_attach
+    int ring_count;
+    rlog_ring_t rings[];
+} rlog_region_t;
+
+static rlog_region_t *rlog_region = NULL;
+static size_t rlog_region_size = 0;
+static rlog_ring_t *rlog_ring = NULL; // ring of this process, NULL while logging is off
+static pid_t rlog_collector = -1;
+static int rlog_level = RLOG_DEBUG;    // messages above it are dropped when logged
+static int rlog_every = 1;             // one in every rlog_every hot-path messages is kept
+static unsigned int rlog_sampled = 0;  // hot-path messages seen by this process
+
+// Parses level[:every] as given on the command line
+static inline int rlog_parse(const char *arg)
+{
+    char *end;
+    long level = strtol(arg, &end, 10);
+    long every = 1;
+    if (*end == ':')
+        every = strtol(end + 1, &end, 10);
+    if (end == arg || *end != '\0' || level < 0 || level > RLOG_DEBUG || every <= 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    rlog_level = level;
+    rlog_every = every;
+    return 0;
+}
+
+static inline long long rlog_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void rlog_write(int level, const char *fmt, const long *args)
+{
+    rlog_ring_t *ring = rlog_ring;
+    if (ring == NULL || level > rlog_level)
+        return;
+    if (level == RLOG_DEBUG && rlog_every > 1 && rlog_sampled++ % rlog_every != 0)
+        return;
+
+    unsigned long pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    rlog_record_t *r;
+    while (1)
+    {
+        r = &ring->cells[pos & (RLOG_RING_SIZE - 1)];
+        long diff = (long)(__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) - pos);
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        }
+        else if (diff < 0)
+        {
+            // Full; never wait, the caller may be a signal handler interrupting the collector's progress
+            __atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+            return;
+        }
+        else
+            pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+    r->ts_ns = rlog_now_ns();
+    r->fmt = fmt;
+    memcpy(r->args, args, sizeof(r->args));
+    r->pid = getpid();
+    r->level = level;
+    __atomic_store_n(&r->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+// Gives the calling process a ring of its own while there are free ones; call it in every child
+// right after fork, until then the child keeps logging into its parent's ring
+static inline void rlog_attach()
+{
+    if (rlog_region == NULL)
+        return;
+    int k = __atomic_fetch_add(&rlog_region->next_ring, 1, __ATOMIC_RELAXED);
+    rlog_ring = &rlog_region->rings[k % rlog_region->ring_count];
+    rlog_sampled = 0;
+}
+
+static inline int rlog_compare(const void *a, const void *b)
+{
+    const rlog_record_t *x = a, *y = b;
+    if (x->ts_ns != y->ts_ns)
+        return x->ts_ns < y->ts_ns ? -1 : 1;
+    return x->pid - y->pid;
+}
+
+static inline int rlog_flush(char *out, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t c = write(STDOUT_FILENO, out, len);
+        if (c == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        out += c;
+        len -= c;
+    }
+    return 0;
+}
+
+// Moves up to max records out of ring into batch; on the final pass records whose writer
+// died before publishing them are skipped instead of waited for
+static inline int rlog_drain(rlog_ring_t *ring, rlog_record_t *batch, int max, int final)
+{
+    int n = 0;
+    unsigned long head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    while (n < max && ring->tail != head)
+    {
+        rlog_record_t *r = &ring->cells[ring->tail & (RLOG_RING_SIZE - 1)];
+        if (__atomic_load_n(&r->seq, __ATOMIC_ACQUIRE) == ring->tail + 1)
+            batch[n++] = *r;
+        else if (!final)
+            break;
+        __atomic_store_n(&r->seq, ring->tail + RLOG_RING_SIZE, __ATOMIC_RELEASE);
+        ring->tail++;
+    }
+    return n;
+}
+
+static inline void rlog_collect(pid_t parent)
+{
+    // Signals meant for the program's process group are not meant for the collector
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGUSR1, SIG_IGN);
+    signal(SIGUSR2, SIG_IGN);
+    size_t out_size = 1 << 16;
+    char *out = malloc(out_size);
+    rlog_record_t *batch = malloc(RLOG_BATCH * sizeof(rlog_record_t));
+    if (out == NULL || batch == NULL)
+        _exit(EXIT_FAILURE);
+
+    int final = 0;
+    int first = 0; // ring drained first, rotated so a busy ring cannot starve the later ones
+    while (1)
+    {
+        // The parent may die without closing the log, then whatever is left is still printed
+        if (__atomic_load_n(&rlog_region->stop, __ATOMIC_ACQUIRE) || getppid() != parent)
+            final = 1;
+        int n = 0;
+        for (int k = 0; k < rlog_region->ring_count && n < RLOG_BATCH; k++)
+        {
+            rlog_ring_t *ring = &rlog_region->rings[(first + k) % rlog_region->ring_count];
+            n += rlog_drain(ring, batch + n, RLOG_BATCH - n, final);
+        }
+        first = (first + 1) % rlog_region->ring_count;
+        qsort(batch, n, sizeof(rlog_record_t), rlog_compare);
+
+        size_t len = 0;
+        for (int i = 0; i < n; i++)
+        {
+            if (out_size - len < 512)
+            {
+                if (rlog_flush(out, len) == -1)
+                    _exit(EXIT_FAILURE);
+                len = 0;
+            }
+            const long *a = batch[i].args;
+            int c = snprintf(out + len, out_size - len, batch[i].fmt, a[0], a[1], a[2], a[3]);
+            if (c < 0)
+                continue; // A format that fails drops its record
+            len += (size_t)c < out_size - len ? (size_t)c : out_size - len - 1; // Truncated to what fit
+        }
+        if (rlog_flush(out, len) == -1)
+            _exit(EXIT_FAILURE);
+
+        if (n == 0)
+        {
+            if (final)
+                break;
+            struct timespec idle = { 0, RLOG_IDLE_MS * 1000000L };
+            nanosleep(&idle, NULL);
+        }
+    }
+
+    unsigned long dropped = 0;
+    for (int k = 0; k < rlog_region->ring_count; k++)
+        dropped += __atomic_load_n(&rlog_region->rings[k].dropped, __ATOMIC_RELAXED);
+    if (dropped > 0)
+        fprintf(stderr, "rlog: %lu records dropped, the rings were full\n", dropped);
+    free(batch);
+    free(out);
+    _exit(EXIT_SUCCESS);
+}
+
+// Maps rings for up to processes logging processes and forks the collector; call it before
+// forking anything else, children inherit the mapping and the calling process's ring.
+// The collector is a child too, so the caller must reap its other children by PID or pidfd.
+static inline int rlog_init(int processes)
+{
+    if (rlog_level == 0)
+        return 0;
+    int rings = processes < RLOG_MAX_RINGS ? processes : RLOG_MAX_RINGS;
+    if (rings < 1)
+        rings = 1;
+    rlog_region_size = sizeof(rlog_region_t) + rings * sizeof(rlog_ring_t);
+    rlog_region = mmap(NULL, rlog_region_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (rlog_region == MAP_FAILED)
+    {
+        rlog_region = NULL;
+        return -1;
+    }
+    rlog_region->ring_count = rings;
+    for (int k = 0; k < rings; k++)
+    {
+        for (int i = 0; i < RLOG_RING_SIZE; i++)
+            rlog_region->rings[k].cells[i].seq = i;
+    }
+
+    pid_t parent = getpid();
+    fflush(stdout); // The collector must not print the parent's buffered output again
+    rlog_collector = fork();
+    if (rlog_collector == -1)
+    {
+        munmap(rlog_region, rlog_region_size);
+        rlog_region = NULL;
+        return -1;
+    }
+    if (rlog_collector == 0)
+        rlog_collect(parent);
+    rlog_attach();
+    return 0;
+}
+
+// Stops logging and waits until the collector has printed every record; call it once the
+// other processes are done logging
+static inline int rlog_close()
+{
+    if (rlog_region == NULL)
+        return 0;
+    rlog_ring = NULL;
+    fflush(stdout);
+    __atomic_store_n(&rlog_region->stop, 1, __ATOMIC_RELEASE);
+    int ret = 0;
+    while (waitpid(rlog_collector, NULL, 0) == -1)
+    {
+        if (errno != EINTR)
+        {
+            ret = -1;
+            break;
+        }
+    }
+    munmap(rlog_region, rlog_region_size);
+    rlog_region = NULL;
+    return ret;
+}
+
+#endif
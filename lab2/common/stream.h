@@ -0,0 +1,266 @@
+#ifndef STREAM_H
+#define STREAM_H
+
+// Streaming pipeline for input that cannot be sliced by offset (a pipe, a terminal): the calling
+// process reads it in fixed-size blocks into the slots of a shared mapping, workers transform
+// the blocks in place in whatever order they get them, and a writer process puts them out in
+// input order. Slots are handed around by index through pipes and one is only refilled once it
+// is written out, so the slots bound both the memory and how far reading runs ahead of writing.
+// Functions return -1 and set errno on failure, like the calls they wrap.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+#define STREAM_BLOCK (1 << 20)       // bytes per block
+#define STREAM_SLOTS_PER_WORKER 4     // blocks in flight per worker, reordering included
+
+typedef struct {
+    unsigned long seq; // position of the block in the input
+    size_t size;       // STREAM_BLOCK except for the last block
+} stream_slot_t;
+
+typedef struct {
+    int slots;
+    stream_slot_t *slot; // shared
+    char *data;          // shared, STREAM_BLOCK bytes per slot
+    int work[2];         // filled slots, reader to workers, one index per packet
+    int done[2];         // transformed slots, workers to writer
+    int free[2];         // written slots, writer to reader
+} stream_t;
+
+static inline ssize_t stream_read_block(int fd, char *buf, size_t count)
+{
+    size_t len = 0;
+    while (len < count)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(read(fd, buf + len, count - len));
+        if (c < 0)
+            return -1;
+        if (c == 0)
+            break; // EOF
+        len += c;
+    }
+    return len;
+}
+
+static inline int stream_write_all(int fd, const char *buf, size_t count)
+{
+    while (count > 0)
+    {
+        ssize_t c = TEMP_FAILURE_RETRY(write(fd, buf, count));
+        if (c < 0)
+            return -1;
+        buf += c;
+        count -= c;
+    }
+    return 0;
+}
+
+static inline int stream_send(int fd, int slot)
+{
+    return TEMP_FAILURE_RETRY(write(fd, &slot, sizeof(slot))) == sizeof(slot) ? 0 : -1;
+}
+
+// Returns 1 with a slot index, 0 at the end of the queue
+static inline int stream_receive(int fd, int *slot)
+{
+    ssize_t c = TEMP_FAILURE_RETRY(read(fd, slot, sizeof(int)));
+    if (c < 0)
+        return -1;
+    return c == sizeof(int);
+}
+
+static inline void stream_worker(stream_t *st, int index, void (*transform)(char *block, size_t size))
+{
+    trace_name("stream worker", index);
+    close(st->work[1]);
+    close(st->done[0]);
+    close(st->free[0]);
+    close(st->free[1]);
+    int s, r;
+    while ((r = stream_receive(st->work[0], &s)) == 1)
+    {
+        long long start = trace_now();
+        transform(st->data + (size_t)s * STREAM_BLOCK, st->slot[s].size);
+        trace_span("transform", start, "seq", st->slot[s].seq, "bytes", st->slot[s].size);
+        if (stream_send(st->done[1], s) == -1)
+            _exit(EXIT_FAILURE);
+    }
+    _exit(r == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Writes the blocks out in input order; a block is held back while an earlier one is still
+// being transformed, and every block in flight fits in the reorder buffer since each has a slot
+static inline void stream_writer(stream_t *st, int out)
+{
+    trace_name("stream writer", -1);
+    close(st->work[0]);
+    close(st->work[1]);
+    close(st->done[1]);
+    close(st->free[0]);
+    int *pending = malloc(st->slots * sizeof(int)); // slot of each block by seq % slots, -1 if none
+    if (pending == NULL)
+        _exit(EXIT_FAILURE);
+    for (int k = 0; k < st->slots; k++)
+        pending[k] = -1;
+    unsigned long next = 0;
+    int s, r;
+    while ((r = stream_receive(st->done[0], &s)) == 1)
+    {
+        pending[st->slot[s].seq % st->slots] = s;
+        while ((s = pending[next % st->slots]) != -1)
+        {
+            long long start = trace_now();
+            if (stream_write_all(out, st->data + (size_t)s * STREAM_BLOCK, st->slot[s].size) == -1)
+                _exit(EXIT_FAILURE);
+            trace_span("write", start, "seq", next, "bytes", st->slot[s].size);
+            pending[next % st->slots] = -1;
+            next++;
+            if (stream_send(st->free[1], s) == -1)
+                _exit(EXIT_FAILURE);
+        }
+    }
+    free(pending);
+    _exit(r == 0 ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+// Waits for a written slot; a child that exits before the input ends has failed, so then the
+// others are killed instead of waiting for blocks that will never come
+static inline int stream_free_slot(stream_t *st, pool_t *pool, int *slot)
+{
+    struct pollfd fds[2] = { { .fd = st->free[0], .events = POLLIN }, { .fd = pool->epfd, .events = POLLIN } };
+    while (1)
+    {
+        if (TEMP_FAILURE_RETRY(poll(fds, 2, -1)) == -1)
+            return -1;
+        if (fds[1].revents & POLLIN)
+            break;
+        if (fds[0].revents & POLLIN)
+            return stream_receive(st->free[0], slot) == 1 ? 0 : -1;
+    }
+    for (int i = 0; i < pool->count; i++)
+    {
+        if (pool->children[i].pidfd != -1)
+            kill(pool->children[i].pid, SIGKILL);
+    }
+    pool_wait_all(pool);
+    errno = ECHILD;
+    return -1;
+}
+
+// Streams in through workers transforming each block into out; the workers and the writer
+// are forked into pool, which holds their usage once this returns. If boundary is set, a full
+// block only goes up to the length it returns and the rest starts the next one, so a block
+// never ends inside a unit transform needs whole (up to 4 bytes, a UTF-8 sequence).
+static inline int stream_run(pool_t *pool, int in, int out, int workers,
+                             void (*transform)(char *block, size_t size),
+                             size_t (*boundary)(const char *block, size_t size))
+{
+    stream_t st;
+    st.slots = workers * STREAM_SLOTS_PER_WORKER;
+    st.slot = mmap(NULL, st.slots * sizeof(stream_slot_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (st.slot == MAP_FAILED)
+        return -1;
+    st.data = mmap(NULL, (size_t)st.slots * STREAM_BLOCK, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (st.data == MAP_FAILED)
+        return -1;
+    // Packet mode, so every worker reads a whole index even while the others read the same pipe
+    if (pipe2(st.work, O_DIRECT) == -1 || pipe(st.done) == -1 || pipe(st.free) == -1)
+        return -1;
+
+    fflush(stdout); // Children must not inherit output the parent has not written yet
+    for (int i = 0; i < workers; i++)
+    {
+        pid_t pid = pool_fork(pool);
+        if (pid == -1)
+            return -1;
+        if (pid == 0)
+            stream_worker(&st, i, transform);
+    }
+    pid_t pid = pool_fork(pool);
+    if (pid == -1)
+        return -1;
+    if (pid == 0)
+        stream_writer(&st, out);
+    close(st.work[0]);
+    close(st.done[0]);
+    close(st.done[1]);
+    close(st.free[1]);
+
+    int ret = 0, saved = 0;
+    int first = pool->count - workers - 1;
+    int unused = 0; // slots never filled, handed out before waiting for written ones
+    unsigned long seq = 0;
+    char carry[4];
+    size_t carried = 0;
+    while (1)
+    {
+        int s;
+        if (unused < st.slots)
+            s = unused++;
+        else if (stream_free_slot(&st, pool, &s) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        char *block = st.data + (size_t)s * STREAM_BLOCK;
+        memcpy(block, carry, carried);
+        long long start = trace_now();
+        ssize_t len = stream_read_block(in, block + carried, STREAM_BLOCK - carried);
+        if (len < 0)
+        {
+            ret = -1;
+            break;
+        }
+        trace_span("read", start, "seq", seq, "bytes", len);
+        len += carried;
+        if (len == 0)
+            break;
+        size_t keep = len;
+        if (boundary != NULL && len == STREAM_BLOCK)
+            keep = boundary(block, len);
+        carried = len - keep;
+        memcpy(carry, block + keep, carried);
+        st.slot[s].seq = seq++;
+        st.slot[s].size = keep;
+        if (stream_send(st.work[1], s) == -1)
+        {
+            ret = -1;
+            break;
+        }
+        if (len < STREAM_BLOCK)
+            break; // Only the last block is short
+    }
+    if (ret == -1)
+        saved = errno;
+
+    close(st.work[1]); // The workers exit once the queue is empty, then the writer once it wrote everything
+    if (pool_wait_all(pool) == -1 && ret == 0)
+    {
+        ret = -1;
+        saved = errno;
+    }
+    for (int i = first; i < pool->count && ret == 0; i++)
+    {
+        if (!WIFEXITED(pool->children[i].status) || WEXITSTATUS(pool->children[i].status) != 0)
+        {
+            ret = -1;
+            saved = ECHILD;
+        }
+    }
+    close(st.free[0]);
+    munmap(st.data, (size_t)st.slots * STREAM_BLOCK);
+    munmap(st.slot, st.slots * sizeof(stream_slot_t));
+    errno = saved;
+    return ret;
+}
+
+#endif
@@ -0,0 +1,165 @@
+#ifndef SUPERVISOR_H
+#define SUPERVISOR_H
+
+// Supervision of workers that each process one chunk of a job: a worker that fails (exits with
+// a non-zero status or is killed) is replaced by a new one for the same chunk after a backoff,
+// up to a number of retries, while the chunks that succeeded are kept.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "pool.h"
+
+#define SUPERVISOR_BACKOFF_MS 100      // before the first retry, doubled for every next one
+#define SUPERVISOR_BACKOFF_MAX_MS 5000
+
+enum { CHUNK_RUNNING, CHUNK_WAITING, CHUNK_DONE, CHUNK_FAILED };
+
+typedef struct {
+    pool_t *pool;
+    int chunks;
+    int max_retries;
+    int *attempts;       // workers started for each chunk so far
+    int *state;          // CHUNK_* of each chunk
+    long long *retry_at; // when a waiting chunk gets its next worker, CLOCK_MONOTONIC ms
+    int *chunk_of;       // chunk of every worker, by pool index
+    char *handled;       // whether the exit of every worker was looked at, by pool index
+    pid_t (*spawn)(int chunk); // adds a worker for chunk to the pool and lets it start, -1 on failure
+} supervisor_t;
+
+static inline long long supervisor_now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// The workers of chunks 0..chunks-1 must already be in the pool at the same indices
+static inline int supervisor_init(supervisor_t *sup, pool_t *pool, int chunks, int max_retries,
+                                  pid_t (*spawn)(int chunk))
+{
+    int workers = chunks * (max_retries + 1);
+    sup->pool = pool;
+    sup->chunks = chunks;
+    sup->max_retries = max_retries;
+    sup->spawn = spawn;
+    sup->attempts = calloc(chunks, sizeof(int));
+    sup->state = calloc(chunks, sizeof(int));
+    sup->retry_at = calloc(chunks, sizeof(long long));
+    sup->chunk_of = calloc(workers, sizeof(int));
+    sup->handled = calloc(workers, sizeof(char));
+    if (sup->attempts == NULL || sup->state == NULL || sup->retry_at == NULL || sup->chunk_of == NULL ||
+        sup->handled == NULL)
+        return -1;
+    for (int i = 0; i < chunks; i++)
+    {
+        sup->attempts[i] = 1;
+        sup->state[i] = CHUNK_RUNNING;
+        sup->chunk_of[i] = i;
+    }
+    return 0;
+}
+
+static inline void supervisor_retry_later(supervisor_t *sup, int chunk, const char *why)
+{
+    if (sup->attempts[chunk] > sup->max_retries)
+    {
+        fprintf(stderr, "Chunk %d: %s, giving up after %d attempts\n", chunk, why, sup->attempts[chunk]);
+        sup->state[chunk] = CHUNK_FAILED;
+        return;
+    }
+    long long backoff = SUPERVISOR_BACKOFF_MS;
+    for (int k = 1; k < sup->attempts[chunk] && backoff < SUPERVISOR_BACKOFF_MAX_MS; k++)
+        backoff *= 2;
+    if (backoff > SUPERVISOR_BACKOFF_MAX_MS)
+        backoff = SUPERVISOR_BACKOFF_MAX_MS;
+    fprintf(stderr, "Chunk %d: %s, retry %d of %d in %lld ms\n", chunk, why, sup->attempts[chunk],
+            sup->max_retries, backoff);
+    sup->state[chunk] = CHUNK_WAITING;
+    sup->retry_at[chunk] = supervisor_now_ms() + backoff;
+}
+
+static inline void supervisor_start(supervisor_t *sup, int chunk)
+{
+    sup->attempts[chunk]++;
+    if (sup->spawn(chunk) == -1)
+    {
+        char why[64];
+        snprintf(why, sizeof(why), "no worker (%s)", strerror(errno));
+        supervisor_retry_later(sup, chunk, why);
+        return;
+    }
+    sup->chunk_of[sup->pool->count - 1] = chunk;
+    sup->state[chunk] = CHUNK_RUNNING;
+}
+
+// Reaps workers and replaces the failed ones until every chunk is done or out of retries;
+// returns how many chunks failed for good, -1 if waiting fails
+static inline int supervise(supervisor_t *sup)
+{
+    while (1)
+    {
+        int pending = 0;
+        long long next = -1;
+        for (int i = 0; i < sup->chunks; i++)
+        {
+            if (sup->state[i] == CHUNK_RUNNING)
+                pending++;
+            if (sup->state[i] == CHUNK_WAITING)
+            {
+                pending++;
+                if (next == -1 || sup->retry_at[i] < next)
+                    next = sup->retry_at[i];
+            }
+        }
+        if (pending == 0)
+            break;
+
+        int timeout = -1;
+        if (next != -1)
+            timeout = next > supervisor_now_ms() ? next - supervisor_now_ms() : 0;
+        if (pool_reap(sup->pool, timeout, NULL) == -1 && errno != EINTR)
+            return -1;
+
+        for (int w = 0; w < sup->pool->count; w++)
+        {
+            pool_child_t *c = &sup->pool->children[w];
+            if (c->pidfd != -1 || sup->handled[w])
+                continue;
+            sup->handled[w] = 1;
+            int chunk = sup->chunk_of[w];
+            if (WIFEXITED(c->status) && WEXITSTATUS(c->status) == 0)
+            {
+                sup->state[chunk] = CHUNK_DONE;
+                continue;
+            }
+            char why[64];
+            pool_format_status(c, why + snprintf(why, sizeof(why), "worker %d ", c->pid), 32);
+            supervisor_retry_later(sup, chunk, why);
+        }
+
+        long long now = supervisor_now_ms();
+        for (int i = 0; i < sup->chunks; i++)
+        {
+            if (sup->state[i] == CHUNK_WAITING && sup->retry_at[i] <= now)
+                supervisor_start(sup, i);
+        }
+    }
+
+    int failed = 0;
+    for (int i = 0; i < sup->chunks; i++)
+        failed += sup->state[i] == CHUNK_FAILED;
+    return failed;
+}
+
+static inline void supervisor_free(supervisor_t *sup)
+{
+    free(sup->attempts);
+    free(sup->state);
+    free(sup->retry_at);
+    free(sup->chunk_of);
+    free(sup->handled);
+}
+
+#endif
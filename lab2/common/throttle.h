@@ -0,0 +1,99 @@
+#ifndef THROTTLE_H
+#define THROTTLE_H
+
+// Token bucket shared by every process forked after throttle_init: together they put out at most
+// rate bytes per second, plus up to burst bytes at once after a pause. The bucket is kept as the
+// time by which every byte taken so far is paid for, so taking bytes is one compare-and-swap and
+// a process then sleeps until its own bytes are due, without a lock or a process refilling it.
+
+#include <errno.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+
+#include "trace.h"
+
+#define THROTTLE_BATCHES_PER_S 100 // a process takes what the rate allows in this part of a second
+#define THROTTLE_MAX_BATCH 65536
+
+typedef struct {
+    long long rate;     // bytes per second
+    long long burst;    // bytes
+    long long burst_ns; // time it takes to earn burst bytes
+    long long paid_ns;  // CLOCK_MONOTONIC time by which the bytes taken so far are paid for
+} throttle_t;
+
+static inline long long throttle_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Parses rate[:burst] as given on the command line
+static inline int throttle_parse(const char *arg, long long *rate, long long *burst)
+{
+    char *end;
+    *rate = strtoll(arg, &end, 10);
+    *burst = 0;
+    if (*end == ':')
+        *burst = strtoll(end + 1, &end, 10);
+    if (end == arg || *end != '\0' || *rate <= 0 || *burst < 0)
+    {
+        errno = EINVAL;
+        return -1;
+    }
+    return 0;
+}
+
+// Maps a bucket that starts full; call it before forking the processes that share it
+static inline throttle_t *throttle_init(long long rate, long long burst)
+{
+    throttle_t *t = mmap(NULL, sizeof(throttle_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (t == MAP_FAILED)
+        return NULL;
+    t->rate = rate;
+    t->burst = burst;
+    t->burst_ns = burst * 1000000000LL / rate;
+    t->paid_ns = throttle_now() - t->burst_ns;
+    return t;
+}
+
+// How many bytes a process should take at once: few enough to keep the output smooth,
+// enough not to pay a system call for every byte
+static inline size_t throttle_batch(const throttle_t *t)
+{
+    long long batch = t->rate / THROTTLE_BATCHES_PER_S;
+    if (batch < 1)
+        return 1;
+    return batch < THROTTLE_MAX_BATCH ? batch : THROTTLE_MAX_BATCH;
+}
+
+// Takes n bytes from the bucket, sleeping until they are earned
+static inline void throttle_take(throttle_t *t, size_t n)
+{
+    long long cost = n * 1000000000LL / t->rate;
+    long long now = throttle_now();
+    long long paid = __atomic_load_n(&t->paid_ns, __ATOMIC_RELAXED);
+    long long due;
+    do
+    {
+        // Time the bucket was idle only counts up to the burst
+        long long from = paid > now - t->burst_ns ? paid : now - t->burst_ns;
+        due = from + cost;
+    } while (!__atomic_compare_exchange_n(&t->paid_ns, &paid, due, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+    if (due <= now)
+        return;
+    long long start = trace_now();
+    struct timespec ts = { due / 1000000000LL, due % 1000000000LL };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+    trace_span("throttle", start, "bytes", n, "wait_us", (due - now) / 1000);
+}
+
+static inline void throttle_free(throttle_t *t)
+{
+    munmap(t, sizeof(throttle_t));
+}
+
+#endif
@@ -0,0 +1,202 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+// Cross-process tracing: every process appends timestamped events to one shared array, and the
+// process that called trace_init writes them as a Chrome trace-event JSON file (one track per PID)
+// once the others are done. Appending takes one atomic add and clock_gettime, so events can be
+// recorded in signal handlers. Everything is a no-op until trace_init is called.
+
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TRACE_EVENTS (1 << 20) // events kept, the rest is counted as dropped
+
+typedef struct {
+    long long ts_ns;
+    long long dur_ns;
+    const char *name; // string literal, shared with every forked process
+    const char *key1, *key2; // argument names, NULL if unused
+    long value1, value2;
+    pid_t pid;
+    char phase; // 'X' span, 'i' instant, 'M' process name (name is the role, value1 the index)
+    char ready; // set last, events reserved by a process that died before filling them are skipped
+} trace_event_t;
+
+typedef struct {
+    long long start_ns;
+    unsigned long next; // events reserved so far
+    pid_t owner;        // writes the file
+    trace_event_t events[TRACE_EVENTS];
+} trace_region_t;
+
+static trace_region_t *trace_region = NULL;
+static const char *trace_path = NULL;
+
+static inline long long trace_now()
+{
+    if (trace_region == NULL)
+        return 0;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline void trace_event(char phase, const char *name, long long ts_ns, long long dur_ns, const char *key1,
+                               long value1, const char *key2, long value2)
+{
+    if (trace_region == NULL)
+        return;
+    unsigned long k = __atomic_fetch_add(&trace_region->next, 1, __ATOMIC_RELAXED);
+    if (k >= TRACE_EVENTS)
+        return;
+    trace_event_t *e = &trace_region->events[k];
+    e->ts_ns = ts_ns;
+    e->dur_ns = dur_ns;
+    e->name = name;
+    e->key1 = key1;
+    e->value1 = value1;
+    e->key2 = key2;
+    e->value2 = value2;
+    e->pid = getpid();
+    e->phase = phase;
+    __atomic_store_n(&e->ready, 1, __ATOMIC_RELEASE);
+}
+
+static inline void trace_instant(const char *name, const char *key1, long value1, const char *key2, long value2)
+{
+    trace_event('i', name, trace_now(), 0, key1, value1, key2, value2);
+}
+
+// Records what happened since start, a trace_now() value
+static inline void trace_span(const char *name, long long start, const char *key1, long value1, const char *key2,
+                              long value2)
+{
+    if (trace_region != NULL)
+        trace_event('X', name, start, trace_now() - start, key1, value1, key2, value2);
+}
+
+// Names the calling process's track "role index", or just "role" if index is negative
+static inline void trace_name(const char *role, long index)
+{
+    trace_event('M', role, trace_now(), 0, NULL, index, NULL, 0);
+}
+
+// A signal handler received sig, from is the sender if known, 0 otherwise
+static inline void trace_signal(int sig, pid_t from)
+{
+    trace_instant("signal", "signal", sig, from > 0 ? "from" : NULL, from);
+}
+
+static inline int trace_kill(pid_t pid, int sig)
+{
+    trace_instant("kill", "to", pid, "signal", sig);
+    return kill(pid, sig);
+}
+
+static inline int trace_sigqueue(pid_t pid, int sig, const union sigval value)
+{
+    trace_instant("sigqueue", "to", pid, "signal", sig);
+    return sigqueue(pid, sig, value);
+}
+
+static inline int trace_nanosleep(const struct timespec *req, struct timespec *rem)
+{
+    long long start = trace_now();
+    int ret = nanosleep(req, rem);
+    int saved = errno;
+    trace_span("sleep", start, "requested_us", req->tv_sec * 1000000L + req->tv_nsec / 1000, NULL, 0);
+    errno = saved;
+    return ret;
+}
+
+static inline int trace_sigsuspend(const sigset_t *mask)
+{
+    long long start = trace_now();
+    int ret = sigsuspend(mask);
+    int saved = errno;
+    trace_span("sigsuspend", start, NULL, 0, NULL, 0);
+    errno = saved;
+    return ret;
+}
+
+// Starts recording into path, written by trace_close; call it before forking anything
+static inline int trace_init(const char *path)
+{
+    trace_region = mmap(NULL, sizeof(trace_region_t), PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (trace_region == MAP_FAILED)
+    {
+        trace_region = NULL;
+        return -1;
+    }
+    trace_path = path;
+    trace_region->owner = getpid();
+    trace_region->start_ns = trace_now();
+    trace_name("parent", -1);
+    return 0;
+}
+
+static inline void trace_write_event(FILE *out, const trace_event_t *e, long long start_ns)
+{
+    double ts = (e->ts_ns - start_ns) / 1000.0; // Trace viewers take microseconds
+    if (e->phase == 'M')
+    {
+        fprintf(out, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": %d, \"tid\": %d, \"args\": {\"name\": \"%s",
+                e->pid, e->pid, e->name);
+        if (e->value1 >= 0)
+            fprintf(out, " %ld", e->value1);
+        fprintf(out, "\"}}");
+        return;
+    }
+    fprintf(out, "{\"name\": \"%s\", \"ph\": \"%c\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d", e->name, e->phase, ts,
+            e->pid, e->pid);
+    if (e->phase == 'X')
+        fprintf(out, ", \"dur\": %.3f", e->dur_ns / 1000.0);
+    else
+        fprintf(out, ", \"s\": \"t\"");
+    fprintf(out, ", \"args\": {");
+    if (e->key1 != NULL)
+        fprintf(out, "\"%s\": %ld%s", e->key1, e->value1, e->key2 != NULL ? ", " : "");
+    if (e->key2 != NULL)
+        fprintf(out, "\"%s\": %ld", e->key2, e->value2);
+    fprintf(out, "}}");
+}
+
+// Writes the trace file; only the process that called trace_init does, once the others are done
+static inline int trace_close()
+{
+    if (trace_region == NULL || trace_region->owner != getpid())
+        return 0;
+    trace_region_t *region = trace_region;
+    trace_region = NULL;
+    unsigned long count = region->next < TRACE_EVENTS ? region->next : TRACE_EVENTS;
+    FILE *out = fopen(trace_path, "w");
+    if (out == NULL)
+    {
+        munmap(region, sizeof(trace_region_t));
+        return -1;
+    }
+    fprintf(out, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    int first = 1;
+    for (unsigned long k = 0; k < count; k++)
+    {
+        if (!__atomic_load_n(&region->events[k].ready, __ATOMIC_ACQUIRE))
+            continue;
+        if (!first)
+            fprintf(out, ",\n");
+        first = 0;
+        trace_write_event(out, &region->events[k], region->start_ns);
+    }
+    fprintf(out, "\n]}\n");
+    if (region->next > TRACE_EVENTS)
+        fprintf(stderr, "trace: %lu events dropped\n", region->next - TRACE_EVENTS);
+    munmap(region, sizeof(trace_region_t));
+    return fclose(out);
+}
+
+#endif
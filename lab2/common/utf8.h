@@ -0,0 +1,121 @@
+#ifndef UTF8_H
+#define UTF8_H
+
+// UTF-8 text in place: splitting it only between code points, and letters and their case for
+// ASCII, Latin-1 Supplement and Latin Extended-A. A case pair of those blocks is always two bytes
+// long on both sides, so swapping the case never changes the length; the few letters whose other
+// case is outside them (ß, ĸ, ŉ) or a different length (İ, ı, ſ) keep their case.
+// Runs of ASCII, which most text mostly is, are found 16 bytes at a time with SSE2 where available.
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define UTF8_CONTINUATION(c) (((unsigned char)(c) & 0xC0) == 0x80)
+
+// Moves offset forward to the first byte of a code point (at most 3 bytes) by looking at fd
+static inline off_t utf8_snap_fd(int fd, off_t offset)
+{
+    unsigned char b[3];
+    ssize_t n = pread(fd, b, sizeof(b), offset);
+    for (ssize_t k = 0; k < n && UTF8_CONTINUATION(b[k]); k++)
+        offset++;
+    return offset;
+}
+
+// Length of the part of buf that ends with a whole code point; the rest starts the next part
+static inline size_t utf8_complete(const char *buf, size_t size)
+{
+    for (size_t back = 1; back <= 4 && back <= size; back++)
+    {
+        unsigned char c = buf[size - back];
+        if (UTF8_CONTINUATION(c))
+            continue;
+        size_t len = c < 0x80 ? 1 : c >= 0xF0 ? 4 : c >= 0xE0 ? 3 : c >= 0xC0 ? 2 : 1;
+        return len > back ? size - back : size;
+    }
+    return size; // Not UTF-8 there, nothing to keep whole
+}
+
+// How many bytes from buf on are ASCII
+static inline size_t utf8_ascii_run(const char *buf, size_t size)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    for (; i + 16 <= size; i += 16)
+    {
+        int high = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(buf + i)));
+        if (high != 0)
+            return i + __builtin_ctz(high);
+    }
+#endif
+    while (i < size && (unsigned char)buf[i] < 0x80)
+        i++;
+    return i;
+}
+
+// Whether code point cp (at most U+017F) is a letter
+static inline int utf8_is_letter(unsigned int cp)
+{
+    if (cp < 0x80)
+        return (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z');
+    if (cp < 0xC0)
+        return cp == 0xAA || cp == 0xB5 || cp == 0xBA;
+    return cp != 0xD7 && cp != 0xF7 && cp <= 0x17F;
+}
+
+static inline int utf8_is_lower(unsigned int cp)
+{
+    if (cp < 0x80)
+        return cp >= 'a' && cp <= 'z';
+    if (cp < 0x100)
+        return cp >= 0xDF && cp != 0xF7;
+    if (cp == 0x138 || cp == 0x149 || cp == 0x17F)
+        return 1;
+    if ((cp >= 0x139 && cp <= 0x148) || (cp >= 0x179 && cp <= 0x17E))
+        return cp % 2 == 0;
+    return cp % 2 == 1 && cp != 0x178;
+}
+
+// The other case of letter cp if it has one of the same length, cp otherwise
+static inline unsigned int utf8_swap_case(unsigned int cp)
+{
+    if (cp < 0x80)
+        return (cp >= 'a' && cp <= 'z') || (cp >= 'A' && cp <= 'Z') ? cp ^ 0x20 : cp;
+    if (cp >= 0xC0 && cp <= 0xFE && cp != 0xD7 && cp != 0xF7 && cp != 0xDF)
+        return cp ^ 0x20;
+    if (cp == 0xFF)
+        return 0x178;
+    if (cp == 0x178)
+        return 0xFF;
+    if (cp < 0x100 || cp > 0x17E || cp == 0x130 || cp == 0x131 || cp == 0x138 || cp == 0x149)
+        return cp;
+    return utf8_is_lower(cp) ? cp - 1 : cp + 1; // Latin Extended-A puts every lower case letter after its upper case
+}
+
+// Decodes the two-byte code point at buf (at most U+07FF) if there is one, returns its length
+static inline size_t utf8_decode2(const char *buf, size_t size, unsigned int *cp)
+{
+    unsigned char c = buf[0];
+    if (c >= 0xC2 && c < 0xE0 && size >= 2 && UTF8_CONTINUATION(buf[1]))
+    {
+        *cp = ((c & 0x1F) << 6) | ((unsigned char)buf[1] & 0x3F);
+        return 2;
+    }
+    *cp = 0; // Longer, or not UTF-8: not a letter here
+    size_t len = 1;
+    while (len < size && len < 4 && UTF8_CONTINUATION(buf[len]))
+        len++;
+    return len;
+}
+
+static inline void utf8_encode2(char *buf, unsigned int cp)
+{
+    buf[0] = 0xC0 | (cp >> 6);
+    buf[1] = 0x80 | (cp & 0x3F);
+}
+
+#endif
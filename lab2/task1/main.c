@@ -1,4 +1,6 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -8,11 +10,49 @@
 #include <unistd.h>
 #include <signal.h>
 
+#include "../common/pool.h"
+#include "../common/rlog.h"
+
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
+#define LEVEL0_BITS 8 // 256 slots of one tick
+#define LEVEL1_BITS 6 // 64 slots of 256 ticks each
+#define LEVEL0_SLOTS (1 << LEVEL0_BITS)
+#define LEVEL1_SLOTS (1 << LEVEL1_BITS)
+#define TICK_NS 1000000L // 1 ms
+#define DRIVER_DONE -1   // batch value a driver thread sends when it stops
+#define SIG_EVENT SIGRTMIN // queued, so events sent up the aggregation tree are never coalesced
+#define FLUSH_MS 10      // how often an aggregator forwards its count
+
 volatile sig_atomic_t last_signal = 0;
 volatile sig_atomic_t sigusr1_count = 0;
+int signal_limit = 100;
+pool_t pool;           // children of this process, reaped through their pidfds
+int tree_mode = 0;
+char *json_path = NULL; // where the children's resource usage also goes if set
+
+// Periodic emitter multiplexed on a driver thread's timer wheel
+typedef struct emitter {
+    long long expires; // tick of the next event
+    int period;        // ms between events
+    struct emitter *next;
+} emitter_t;
+
+// Hierarchical timer wheel of one driver thread: level 0 holds events due within
+// LEVEL0_SLOTS ticks, level 1 the later ones, cascaded down as level 0 wraps around
+typedef struct {
+    pthread_t tid;
+    int first, count;  // emitters owned by the thread
+    emitter_t *emitters;
+    emitter_t *level0[LEVEL0_SLOTS];
+    emitter_t *level1[LEVEL1_SLOTS];
+    long long now;     // ticks processed so far
+    struct timespec start;
+} driver_t;
+
+volatile int stop_drivers = 0;
+int batch_pipe[2];     // drivers send the number of events fired in each batch to the parent
 
 void sethandler(void (*f)(int), int sigNo)
 {
@@ -25,45 +65,56 @@ void sethandler(void (*f)(int), int sigNo)
 
 void sig_handler(int sig) 
 {
+    trace_signal(sig, 0);
     if (sig == SIGUSR1)
     {
         sigusr1_count++;
-        printf("parent received %d SIGUSR1 signals\n", sigusr1_count);
-        if (sigusr1_count >= 100)
+        RLOG(RLOG_DEBUG, "parent received %ld SIGUSR1 signals\n", sigusr1_count);
+        if (sigusr1_count >= signal_limit)
         {
-            kill(0, SIGUSR2); // Send SIGUSR2 to all child processes
+            trace_kill(0, SIGUSR2); // Send SIGUSR2 to all child processes
         }
     }
     last_signal = sig;
 }
 
-void sigchld_handler(int sig)
+void sigusr2_handler(int sig)
 {
-    pid_t pid;
-    for (;;)
-    {
-        pid = waitpid(0, NULL, WNOHANG);
-        if (pid == 0)
-            return;
-        if (pid <= 0)
-        {
-            if (errno == ECHILD)
-                return;
-            ERR("waitpid");
-        }
-    }
+    trace_signal(sig, 0);
+    exit(EXIT_SUCCESS);
 }
 
-void sigusr2_handler(int sig)
+long long now_ms()
 {
-    exit(EXIT_SUCCESS);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void emit_event(pid_t pid)
+{
+    if (!tree_mode)
+    {
+        trace_kill(pid, SIGUSR1);
+        return;
+    }
+    union sigval value = { .sival_int = 1 };
+    while (trace_sigqueue(pid, SIG_EVENT, value) == -1)
+    {
+        if (errno != EAGAIN)
+            ERR("sigqueue");
+        struct timespec backoff = { 0, 1000000L }; // The aggregator's queue is full, let it drain
+        trace_nanosleep(&backoff, NULL);
+    }
 }
 
 void child_work(int i)
 {
+    rlog_attach();
+    trace_name("child", i);
     srand(time(NULL) * getpid());
     int t = 100 + rand() % (200 - 100 + 1); // Random time between 100 and 200 milliseconds
-    printf("PROCESS with pid %d chose %d ms\n", getpid(), t);
+    RLOG(RLOG_INFO, "PROCESS with pid %ld chose %ld ms\n", getpid(), t);
     
     struct timespec req;
     req.tv_sec = t / 1000;
@@ -72,22 +123,28 @@ void child_work(int i)
     pid_t parent_pid = getppid();
 
     sethandler(sigusr2_handler, SIGUSR2);
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL); // Blocked by aggregators, which wait for it synchronously
 
     while (1)
     {
-        nanosleep(&req, NULL);
-        kill(parent_pid, SIGUSR1);
+        trace_nanosleep(&req, NULL);
+        emit_event(parent_pid);
     }
     
-    printf("PROCESS with pid %d terminates\n", getpid());
+    RLOG(RLOG_INFO, "PROCESS with pid %ld terminates\n", getpid());
 }
 
 void create_children(int n)
 {
     pid_t s;
+    if (pool_init(&pool, n) == -1)
+        ERR("pool_init");
     for (n--; n >= 0; n--)
     {
-        if ((s = fork()) < 0)
+        if ((s = pool_fork(&pool)) < 0)
             ERR("Fork:");
         if (!s)
         {
@@ -97,23 +154,403 @@ void create_children(int n)
     }
 }
 
+// Prints what every child of this process cost once they are all reaped
+void report_usage()
+{
+    pool_print_usage(stdout, pool.children, pool.count, pool.count);
+    if (json_path != NULL && pool_write_usage_json(json_path, pool.children, pool.count) == -1)
+        ERR("pool_write_usage_json");
+}
+
+// Forwards a batch of events up the tree as the value of one queued signal
+void forward_events(pid_t pid, int events)
+{
+    union sigval value = { .sival_int = events };
+    while (trace_sigqueue(pid, SIG_EVENT, value) == -1)
+    {
+        if (errno != EAGAIN)
+            ERR("sigqueue");
+        struct timespec backoff = { 0, 1000000L };
+        trace_nanosleep(&backoff, NULL);
+    }
+}
+
+// Counts the events of leaves first..first+count-1 and forwards them to the parent every FLUSH_MS;
+// on SIGUSR2 stops its leaves and forwards what is left once they are gone
+void aggregator_work(int first, int count)
+{
+    rlog_attach();
+    pid_t parent_pid = getppid();
+    pool_free(&pool); // The parent's pool, an aggregator has leaves of its own
+    if (pool_init(&pool, count) == -1)
+        ERR("pool_init");
+    for (int k = 0; k < count; k++)
+    {
+        pid_t pid = pool_fork(&pool);
+        if (pid < 0)
+            ERR("Fork:");
+        if (!pid)
+        {
+            child_work(first + k);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIG_EVENT);
+    sigaddset(&mask, SIGUSR2);
+    int pending = 0;
+    long long next_flush = now_ms() + FLUSH_MS;
+    for (;;)
+    {
+        long long left = next_flush - now_ms();
+        if (left > 0)
+        {
+            struct timespec timeout = { left / 1000, (left % 1000) * 1000000L };
+            siginfo_t info;
+            int sig = sigtimedwait(&mask, &info, &timeout);
+            if (sig > 0)
+                trace_signal(sig, info.si_pid);
+            if (sig == SIG_EVENT)
+                pending += info.si_value.sival_int;
+            if (sig == SIGUSR2)
+                break;
+            if (sig == -1 && errno != EAGAIN && errno != EINTR)
+                ERR("sigtimedwait");
+            continue;
+        }
+        if (pending > 0)
+            forward_events(parent_pid, pending);
+        pending = 0;
+        next_flush += FLUSH_MS;
+    }
+
+    // Propagate the termination down, then count every event the leaves managed to queue
+    for (int k = 0; k < count; k++)
+        trace_kill(pool.children[k].pid, SIGUSR2);
+    if (pool_wait_all(&pool) == -1)
+        ERR("pool_wait_all");
+    sigdelset(&mask, SIGUSR2);
+    struct timespec zero = { 0, 0 };
+    siginfo_t info;
+    while (sigtimedwait(&mask, &info, &zero) == SIG_EVENT)
+        pending += info.si_value.sival_int;
+    if (pending > 0)
+        forward_events(parent_pid, pending);
+    pool_free(&pool);
+}
+
+// Runs n leaves under aggregators of up to b leaves each and sums the batches they forward
+void run_tree(int n, int b)
+{
+    int count = (n + b - 1) / b;
+    if (pool_init(&pool, count) == -1)
+        ERR("pool_init");
+
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIG_EVENT);
+    sigaddset(&mask, SIGUSR2);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL); // Inherited, so nothing sent before a process waits is lost
+
+    for (int a = 0; a < count; a++)
+    {
+        pid_t pid = pool_fork(&pool);
+        if (pid < 0)
+            ERR("Fork:");
+        if (!pid)
+        {
+            trace_name("aggregator", a);
+            int first = a * b;
+            aggregator_work(first, first + b <= n ? b : n - first);
+            exit(EXIT_SUCCESS);
+        }
+    }
+
+    long long total = 0;
+    int batches = 0, stopping = 0;
+    sigdelset(&mask, SIGUSR2);
+    while (pool.alive > 0)
+    {
+        siginfo_t info;
+        int sig = sigwaitinfo(&mask, &info);
+        if (sig == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            ERR("sigwaitinfo");
+        }
+        trace_signal(sig, info.si_pid);
+        if (sig == SIGCHLD)
+        {
+            // Only a wakeup, the exits are reaped through the pidfds; SIGCHLD coalesces and one
+            // pool_reap takes at most POOL_EVENTS exits, so reap until none is left
+            int r;
+            while ((r = pool_reap(&pool, 0, NULL)) != 0)
+            {
+                if (r == -1 && errno != EINTR)
+                    ERR("pool_reap");
+            }
+            continue;
+        }
+        total += info.si_value.sival_int;
+        batches++;
+        if (!stopping)
+            RLOG(RLOG_DEBUG, "parent received %ld events (batch of %ld from PID %ld)\n", total,
+                 info.si_value.sival_int, info.si_pid);
+        if (total >= signal_limit && !stopping)
+        {
+            stopping = 1;
+            for (int a = 0; a < count; a++)
+                trace_kill(pool.children[a].pid, SIGUSR2);
+        }
+    }
+
+    // The last batches were queued before their aggregators exited
+    struct timespec zero = { 0, 0 };
+    siginfo_t info;
+    sigdelset(&mask, SIGCHLD);
+    while (sigtimedwait(&mask, &info, &zero) == SIG_EVENT)
+    {
+        total += info.si_value.sival_int;
+        batches++;
+    }
+    if (rlog_close() == -1)
+        ERR("rlog_close");
+    printf("%lld events from %d leaves via %d aggregators in %d batches\n", total, n, count, batches);
+    report_usage();
+    pool_free(&pool);
+    if (trace_close() == -1)
+        ERR("trace_close");
+}
+
+void wheel_insert(driver_t *d, emitter_t *e)
+{
+    long long delta = e->expires - d->now;
+    if (delta < LEVEL0_SLOTS)
+    {
+        e->next = d->level0[e->expires & (LEVEL0_SLOTS - 1)];
+        d->level0[e->expires & (LEVEL0_SLOTS - 1)] = e;
+        return;
+    }
+    if (delta >= (long long)LEVEL0_SLOTS * LEVEL1_SLOTS)
+        e->expires = d->now + (long long)LEVEL0_SLOTS * LEVEL1_SLOTS - 1; // Longest wait the wheel holds
+    int slot = (e->expires >> LEVEL0_BITS) & (LEVEL1_SLOTS - 1);
+    e->next = d->level1[slot];
+    d->level1[slot] = e;
+}
+
+// Advances the wheel by one tick; returns how many emitters fired
+int wheel_tick(driver_t *d)
+{
+    d->now++;
+    int slot = d->now & (LEVEL0_SLOTS - 1);
+    if (slot == 0)
+    {
+        // Level 0 wrapped around: the level 1 slot now within reach is spread over level 0
+        emitter_t **upper = &d->level1[(d->now >> LEVEL0_BITS) & (LEVEL1_SLOTS - 1)];
+        emitter_t *e = *upper;
+        *upper = NULL;
+        while (e != NULL)
+        {
+            emitter_t *next = e->next;
+            wheel_insert(d, e);
+            e = next;
+        }
+    }
+
+    int fired = 0;
+    emitter_t *e = d->level0[slot];
+    d->level0[slot] = NULL;
+    while (e != NULL)
+    {
+        emitter_t *next = e->next;
+        fired++;
+        e->expires += e->period;
+        wheel_insert(d, e);
+        e = next;
+    }
+    return fired;
+}
+
+void send_batch(int events)
+{
+    // Writes up to PIPE_BUF are atomic, so batches of different drivers never mix
+    if (TEMP_FAILURE_RETRY(write(batch_pipe[1], &events, sizeof(events))) != sizeof(events))
+        ERR("write");
+}
+
+void *driver_work(void *arg)
+{
+    driver_t *d = arg;
+    unsigned int seed = time(NULL) ^ (d->first * 2654435761u);
+    for (int k = 0; k < d->count; k++)
+    {
+        emitter_t *e = &d->emitters[k];
+        e->period = 100 + rand_r(&seed) % (200 - 100 + 1); // Random time between 100 and 200 milliseconds
+        e->expires = e->period;
+        wheel_insert(d, e);
+    }
+
+    while (!__atomic_load_n(&stop_drivers, __ATOMIC_RELAXED))
+    {
+        struct timespec next = d->start;
+        long long ns = next.tv_nsec + (d->now + 1) * TICK_NS;
+        next.tv_sec += ns / 1000000000L;
+        next.tv_nsec = ns % 1000000000L;
+        int err = clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL);
+        if (err != 0 && err != EINTR)
+            ERR("clock_nanosleep");
+
+        // Catch up on every tick that has passed and report them as one batch
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long due = ((now.tv_sec - d->start.tv_sec) * 1000000000LL + now.tv_nsec - d->start.tv_nsec) / TICK_NS;
+        int fired = 0;
+        while (d->now < due)
+            fired += wheel_tick(d);
+        if (fired > 0)
+            send_batch(fired);
+    }
+    send_batch(DRIVER_DONE);
+    return NULL;
+}
+
+// Runs n emitters on the timer wheels of t driver threads and counts their events in batches
+void run_drivers(int n, int t)
+{
+    driver_t *drivers = calloc(t, sizeof(driver_t));
+    emitter_t *emitters = calloc(n, sizeof(emitter_t));
+    if (drivers == NULL || emitters == NULL)
+        ERR("calloc");
+    if (pipe(batch_pipe) == -1)
+        ERR("pipe");
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int k = 0; k < t; k++)
+    {
+        drivers[k].first = (long long)n * k / t;
+        drivers[k].count = (long long)n * (k + 1) / t - drivers[k].first;
+        drivers[k].emitters = emitters + drivers[k].first;
+        drivers[k].start = start;
+        errno = pthread_create(&drivers[k].tid, NULL, driver_work, &drivers[k]);
+        if (errno != 0)
+            ERR("pthread_create");
+    }
+
+    long long total = 0;
+    int batches = 0, running = t;
+    while (running > 0)
+    {
+        int events;
+        if (TEMP_FAILURE_RETRY(read(batch_pipe[0], &events, sizeof(events))) != sizeof(events))
+            ERR("read");
+        if (events == DRIVER_DONE)
+        {
+            running--;
+            continue;
+        }
+        total += events;
+        batches++;
+        if (!stop_drivers)
+            RLOG(RLOG_DEBUG, "parent received %ld events (batch of %ld)\n", total, events);
+        if (total >= signal_limit && !stop_drivers)
+            __atomic_store_n(&stop_drivers, 1, __ATOMIC_RELAXED);
+    }
+    for (int k = 0; k < t; k++)
+        pthread_join(drivers[k].tid, NULL);
+    if (rlog_close() == -1)
+        ERR("rlog_close");
+    printf("%lld events from %d emitters on %d threads in %d batches\n", total, n, t, batches);
+    if (trace_close() == -1)
+        ERR("trace_close");
+
+    close(batch_pipe[0]);
+    close(batch_pipe[1]);
+    free(emitters);
+    free(drivers);
+}
+
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s 0<n\n", name);
+    fprintf(stderr, "USAGE: %s [-t threads | -b fanout] [-l limit] [-j json_path] [-L level[:every]]\n"
+                    "\t[-e trace_path] 0<n\n", name);
+    fprintf(stderr, "\tthreads - run the n emitters on timer wheels of that many threads instead of processes\n");
+    fprintf(stderr, "\tfanout - leaves per aggregator process, which forwards their counts in batches\n");
+    fprintf(stderr, "\tlimit - events after which everything stops (default 100)\n");
+    fprintf(stderr, "\tjson_path - also write the resource usage of the child processes there as JSON\n");
+    fprintf(stderr, "\tlevel - 0 logs nothing, 1 only process lifecycle, 2 also every event (default);\n"
+                    "\t\tevery - log one in every that many events (default 1)\n");
+    fprintf(stderr, "\ttrace_path - write a Chrome trace of the forks, signals, sleeps and reaps there\n");
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char **argv)
 {
     int n;
-    if (argc < 2)
+    int threads = 0;
+    int fanout = 0;
+    char *trace_file = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "t:b:l:j:L:e:")) != -1)
+    {
+        switch (c)
+        {
+            case 't':
+                threads = atoi(optarg);
+                if (threads <= 0)
+                    usage(argv[0]);
+                break;
+            case 'b':
+                fanout = atoi(optarg);
+                if (fanout <= 0)
+                    usage(argv[0]);
+                tree_mode = 1;
+                break;
+            case 'l':
+                signal_limit = atoi(optarg);
+                if (signal_limit <= 0)
+                    usage(argv[0]);
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'e':
+                trace_file = optarg;
+                break;
+            case 'L':
+                if (rlog_parse(optarg) == -1)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind < 1)
         usage(argv[0]);
-    n = atoi(argv[1]);
+    n = atoi(argv[optind]);
     if (n <= 0)
         usage(argv[0]);
+    if (trace_file != NULL && trace_init(trace_file) == -1)
+        ERR("trace_init");
+    // The collector is forked before anything else, so no other child inherits it
+    if (rlog_init(threads > 0 ? 1 : n + 1) == -1)
+        ERR("rlog_init");
+    if (threads > 0)
+    {
+        run_drivers(n, threads < n ? threads : n);
+        return EXIT_SUCCESS;
+    }
+    if (tree_mode)
+    {
+        run_tree(n, fanout);
+        return EXIT_SUCCESS;
+    }
 
     sethandler(sig_handler, SIGUSR1);
-    sethandler(sigchld_handler, SIGCHLD);
 
     sigset_t mask, oldmask;
     sigemptyset(&mask);
@@ -121,11 +558,18 @@ int main(int argc, char **argv)
     sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
     create_children(n);
+    sethandler(SIG_IGN, SIGUSR2); // The SIGUSR2 sent to the whole group only stops the children
 
     sigprocmask(SIG_UNBLOCK, &mask, NULL);
 
-    while (wait(NULL) > 0 || errno == EINTR)
-        ;
+    if (pool_wait_all(&pool) == -1)
+        ERR("pool_wait_all");
+    if (rlog_close() == -1)
+        ERR("rlog_close");
+    report_usage();
+    pool_free(&pool);
+    if (trace_close() == -1)
+        ERR("trace_close");
 
     return EXIT_SUCCESS;
 }
\ No newline at end of file
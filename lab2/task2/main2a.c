@@ -1,30 +1,109 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
 #include <sys/time.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 #include <signal.h>
 
+#include "../common/pool.h"
+#include "../common/rlog.h"
+
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
+// Realtime signals are queued, so submissions from many students are never coalesced.
+// Both carry the 1-based part number in si_value.
+#define SIG_SUBMIT (SIGRTMIN)
+#define SIG_ACCEPT (SIGRTMIN + 1)
+
 volatile sig_atomic_t last_signal = 0;
 volatile sig_atomic_t sigusr1_count = 0;
-volatile sig_atomic_t sigusr1_sender_pid = 0;
-volatile sig_atomic_t sigusr2_received = 0;
+volatile sig_atomic_t accepted_parts = 0;
+volatile sig_atomic_t snapshot_requested = 0;
 
 typedef struct {
     pid_t pid;
     int issues;
+    int teacher;
+    int status;          // wait status from the teacher
+    struct rusage usage; // resources the student used
 } student_info_t;
 
+typedef struct {
+    int teacher;
+    int accepted;
+    int students;
+    int issues;
+} teacher_stats_t;
+
+#define CACHE_LINE 64
+#define HIST_BUCKETS 16
+#define REPORT_ROWS 1000 // students listed in the usage report, the totals cover the rest
+
+enum student_state { STUDENT_WAITING, STUDENT_WORKING, STUDENT_SUBMITTED, STUDENT_DONE };
+
+// Live per-student record in shared memory, written only by its student and read by anyone.
+// Records are padded to whole cache lines so students never share a line.
+typedef struct {
+    pid_t pid;
+    int state;
+    int part; // part currently worked on or submitted, 1-based
+    int issues;
+    int parts_done;
+    long long sleep_overshoot_ns; // time slept beyond what nanosleep was asked for
+    long long accept_wait_ns;     // total time from submission to acceptance over all parts
+    long long stall_ns;           // time blocked because too many parts were awaiting acceptance
+    long long part_ns[];          // duration of each part, p entries
+} student_stats_t;
+
+char *stats_region = NULL;
+size_t stats_stride = 0;
+size_t stats_size = 0;
+
 student_info_t *students = NULL;
 int student_count = 0;
 int total_issues = 0;
 
+// Every student draws issues from its own stream derived from the run seed,
+// so a real run and a simulated one with the same seed see the same issues
+unsigned int run_seed = 0;
+
+// Shard owned by the current teacher: students first, first + step, ...
+int shard_first = 0;
+int shard_step = 1;
+
+// Parts a student may keep awaiting acceptance while working on the next one
+int window = 0;
+
+// Acceptances a teacher could not queue yet because the student's signal queue was full
+// (RLIMIT_SIGPENDING), retried from the main loop every ACCEPT_RETRY_MS. A student has at most
+// window + 1 parts awaiting acceptance, which bounds how many there can be.
+#define ACCEPT_RETRY_MS 10
+
+typedef struct {
+    pid_t pid;
+    int part;
+} acceptance_t;
+
+acceptance_t *unsent = NULL;
+int unsent_count = 0;
+int unsent_capacity = 0;
+
+// Student side: own record and submission time of every part, used by accept_handler
+student_stats_t *own_stats = NULL;
+long long *submitted_at = NULL;
+int part_count = 0;
+pool_t pool; // children of this process: teachers in the parent, students in a teacher
+char *json_path = NULL; // where the students' resource usage also goes if set
+
 void sethandler(void (*f)(int, siginfo_t *, void *), int sigNo)
 {
     struct sigaction act;
@@ -35,167 +114,837 @@ void sethandler(void (*f)(int, siginfo_t *, void *), int sigNo)
         ERR("sigaction");
 }
 
-void sigusr1_handler(int sig, siginfo_t *info, void *context)
+ssize_t bulk_read(int fd, char *buf, size_t count)
 {
-    if (sig == SIGUSR1)
+    ssize_t c;
+    ssize_t len = 0;
+    long long start = trace_now();
+    do
     {
-        sigusr1_count++;
-        sigusr1_sender_pid = info->si_pid; // Get sender PID
-        printf("Teacher has accepted solution of student [%d].\n", sigusr1_sender_pid);
+        c = TEMP_FAILURE_RETRY(read(fd, buf, count));
+        if (c < 0)
+            return c;
+        if (c == 0)
+            break; // EOF
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    trace_span("read", start, "fd", fd, "bytes", len);
+    return len;
+}
+
+ssize_t bulk_write(int fd, char *buf, size_t count)
+{
+    ssize_t c;
+    ssize_t len = 0;
+    long long start = trace_now();
+    do
+    {
+        c = TEMP_FAILURE_RETRY(write(fd, buf, count));
+        if (c < 0)
+            return c;
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    trace_span("write", start, "fd", fd, "bytes", len);
+    return len;
+}
+
+unsigned int student_seed(int i)
+{
+    uint32_t x = run_seed ^ ((uint32_t)i * 2654435761u);
+    x ^= x >> 16;
+    x *= 0x45d9f3bu;
+    x ^= x >> 16;
+    return x;
+}
+
+student_stats_t *stats_of(int i)
+{
+    return (student_stats_t *)(stats_region + i * stats_stride);
+}
+
+void stats_init(int n, int p)
+{
+    stats_stride = (sizeof(student_stats_t) + p * sizeof(long long) + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1);
+    stats_size = n * stats_stride;
+    // Anonymous shared mapping is page aligned, so every record starts on a cache line
+    stats_region = mmap(NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (stats_region == MAP_FAILED)
+        ERR("mmap");
+}
+
+#define STAT_STORE(field, value) __atomic_store_n(&(field), (value), __ATOMIC_RELAXED)
+#define STAT_LOAD(field) __atomic_load_n(&(field), __ATOMIC_RELAXED)
+
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Sleeps and accounts how late the kernel woke the student up; acceptances arriving meanwhile
+// interrupt the sleep, which then goes on for the time left
+void timed_sleep(student_stats_t *st, const struct timespec *req)
+{
+    long long start = now_ns();
+    struct timespec left = *req;
+    while (trace_nanosleep(&left, &left) == -1 && errno == EINTR)
+        ;
+    long long over = now_ns() - start - (req->tv_sec * 1000000000LL + req->tv_nsec);
+    if (over > 0)
+        STAT_STORE(st->sleep_overshoot_ns, st->sleep_overshoot_ns + over);
+}
+
+void print_snapshot()
+{
+    static const char *names[] = { "waiting", "working", "submitted", "done" };
+    printf("--- Snapshot ---\n");
+    printf("No. | Student ID | State     | Part | Done | Issues | Overshoot ms | Accept wait ms | Stall ms\n");
+    for (int i = 0; i < student_count; i++)
+    {
+        student_stats_t *st = stats_of(i);
+        int state = STAT_LOAD(st->state);
+        printf("%3d | %10d | %-9s | %4d | %4d | %6d | %12.1f | %14.1f | %8.1f\n", i + 1, STAT_LOAD(st->pid),
+               names[state], STAT_LOAD(st->part), STAT_LOAD(st->parts_done), STAT_LOAD(st->issues),
+               STAT_LOAD(st->sleep_overshoot_ns) / 1e6, STAT_LOAD(st->accept_wait_ns) / 1e6,
+               STAT_LOAD(st->stall_ns) / 1e6);
     }
-    last_signal = sig;
+    fflush(stdout);
 }
 
-void sigchld_handler(int sig, siginfo_t *info, void *context)
+// Power-of-two millisecond buckets of part durations over all students
+void print_histograms(int p)
 {
-    pid_t pid;
-    int status;
-    for (;;)
+    for (int j = 0; j < p; j++)
     {
-        pid = waitpid(-1, &status, WNOHANG);
-        if (pid == 0)
-            return;
-        if (pid <= 0)
+        int hist[HIST_BUCKETS] = { 0 };
+        for (int i = 0; i < student_count; i++)
         {
-            if (errno == ECHILD)
-                return;
-            ERR("waitpid");
+            student_stats_t *st = stats_of(i);
+            if (st->parts_done <= j)
+                continue;
+            long long ms = st->part_ns[j] / 1000000;
+            int b = 0;
+            while (b < HIST_BUCKETS - 1 && ms >= (1LL << b))
+                b++;
+            hist[b]++;
         }
-        if (WIFEXITED(status))
+        printf("Part %d duration histogram:\n", j + 1);
+        for (int b = 0; b < HIST_BUCKETS; b++)
         {
-            int issues = WEXITSTATUS(status);
-            for (int i = 0; i < student_count; i++)
-            {
-                if (students[i].pid == pid)
-                {
-                    students[i].issues = issues;
-                    total_issues += issues;
-                    break;
-                }
-            }
+            if (hist[b] == 0)
+                continue;
+            if (b == HIST_BUCKETS - 1)
+                printf("  >= %6lld ms | %d\n", 1LL << (b - 1), hist[b]);
+            else
+                printf("  < %7lld ms | %d\n", 1LL << b, hist[b]);
+        }
+    }
+}
+
+void sigusr1_handler(int sig, siginfo_t *info, void *context)
+{
+    trace_signal(sig, info->si_pid);
+    if (sig == SIG_SUBMIT)
+    {
+        sigusr1_count++;
+        RLOG(RLOG_DEBUG, "Teacher [%ld] has accepted part %ld of student [%ld].\n", getpid(),
+             info->si_value.sival_int, info->si_pid);
+        // Accept directly, so no submission waits for the main loop
+        int saved = errno;
+        if (trace_sigqueue(info->si_pid, SIG_ACCEPT, info->si_value) == -1 && errno == EAGAIN &&
+            unsent_count < unsent_capacity)
+        {
+            unsent[unsent_count].pid = info->si_pid;
+            unsent[unsent_count].part = info->si_value.sival_int;
+            unsent_count++;
         }
+        errno = saved;
+    }
+    last_signal = sig;
+}
+
+// Retries the acceptances the handler could not queue, called with SIG_SUBMIT blocked;
+// returns the timeout to wait with until the next retry, -1 if none is needed
+int resend_acceptances()
+{
+    int kept = 0;
+    for (int k = 0; k < unsent_count; k++)
+    {
+        union sigval part = { .sival_int = unsent[k].part };
+        if (trace_sigqueue(unsent[k].pid, SIG_ACCEPT, part) == 0)
+            continue;
+        if (errno == EAGAIN)
+            unsent[kept++] = unsent[k];
+        else if (errno != ESRCH) // A student that is gone needs no acceptance
+            ERR("sigqueue");
+    }
+    unsent_count = kept;
+    return unsent_count > 0 ? ACCEPT_RETRY_MS : -1;
+}
+
+// Students of a teacher are forked in shard order, so the pool index gives the student
+void student_exited(pool_t *pool, int index)
+{
+    int i = shard_first + index * shard_step;
+    students[i].status = pool->children[index].status;
+    students[i].usage = pool->children[index].usage;
+    if (WIFEXITED(pool->children[index].status))
+    {
+        students[i].issues = STAT_LOAD(stats_of(i)->issues);
+        total_issues += students[i].issues;
     }
 }
 
-void sigusr2_handler(int sig, siginfo_t *info, void *context)
+void accept_handler(int sig, siginfo_t *info, void *context)
 {
-    sigusr2_received = 1;
+    trace_signal(sig, info->si_pid);
+    int part = info->si_value.sival_int;
+    if (part < 1 || part > part_count)
+        return;
+    // The handler is the only writer of these fields, so plain stores stay lock-free
+    STAT_STORE(own_stats->accept_wait_ns, own_stats->accept_wait_ns + now_ns() - submitted_at[part - 1]);
+    STAT_STORE(own_stats->parts_done, own_stats->parts_done + 1);
+    accepted_parts++;
+}
+
+void snapshot_handler(int sig, siginfo_t *info, void *context)
+{
+    trace_signal(sig, info->si_pid);
+    snapshot_requested = 1;
 }
 
 void child_work(int i, int prob, int p, int t)
 {
+    rlog_attach();
+    trace_name("student", i);
+    student_stats_t *st = stats_of(i);
     int problems = 0;
-    srand(time(NULL) * getpid());
+    unsigned int rng = student_seed(i);
     t = 100 * t;
     struct timespec req;
     req.tv_sec = t / 1000;
     req.tv_nsec = (t % 1000) * 1000000L;
-    printf("Student [%d, %d] has started doing task!\n", i, getpid());
+    own_stats = st;
+    part_count = p;
+    submitted_at = calloc(p > 0 ? p : 1, sizeof(long long));
+    if (submitted_at == NULL)
+        ERR("calloc");
+    STAT_STORE(st->pid, getpid());
+    RLOG(RLOG_INFO, "Student [%ld, %ld] has started doing task!\n", i, getpid());
+
+    // SIG_ACCEPT is let in while working, so every acceptance is accounted when it arrives;
+    // it is only blocked between checking accepted_parts and waiting for the next one
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIG_ACCEPT);
 
     for (int j = 0; j < p; j++)
     {
-        printf("Student [%d, %d] has started doing part %d of %d!\n", i, getpid(), j + 1, p);
+        RLOG(RLOG_DEBUG, "Student [%ld, %ld] has started doing part %ld of %ld!\n", i, getpid(), j + 1, p);
+        long long part_start = now_ns();
+        STAT_STORE(st->part, j + 1);
+        STAT_STORE(st->state, STUDENT_WORKING);
 
         for (int k = 0; k < t / 100; k++)
         {
-            nanosleep(&req, NULL);
-            if (rand() % 100 < prob)
+            timed_sleep(st, &req);
+            if (rand_r(&rng) % 100 < prob)
             {
                 struct timespec extra_req;
                 extra_req.tv_sec = 0;
                 extra_req.tv_nsec = 50000000L; // 50 ms
-                nanosleep(&extra_req, NULL);
-                printf("Student [%d, %d] has an issue (%d) doing task!\n", i, getpid(), problems + 1);
+                timed_sleep(st, &extra_req);
+                RLOG(RLOG_DEBUG, "Student [%ld, %ld] has an issue (%ld) doing task!\n", i, getpid(), problems + 1);
                 problems++;
+                STAT_STORE(st->issues, problems);
             }
         }
 
-        printf("Student [%d, %d] has finished part %d of %d!\n", i, getpid(), j + 1, p);
-        kill(getppid(), SIGUSR1);
+        RLOG(RLOG_DEBUG, "Student [%ld, %ld] has finished part %ld of %ld!\n", i, getpid(), j + 1, p);
+        submitted_at[j] = now_ns();
+        STAT_STORE(st->part_ns[j], submitted_at[j] - part_start);
+        union sigval part = { .sival_int = j + 1 };
+        while (trace_sigqueue(getppid(), SIG_SUBMIT, part) == -1)
+        {
+            if (errno != EAGAIN)
+                ERR("sigqueue");
+            // The teacher's signal queue is full, wait for it to take some
+            struct timespec retry = { 0, ACCEPT_RETRY_MS * 1000000L };
+            trace_nanosleep(&retry, NULL);
+        }
 
-        while (!sigusr2_received)
+        // Keep working while at most window parts await acceptance; the last part waits for all
+        int allowed = (j == p - 1) ? 0 : window;
+        sigprocmask(SIG_BLOCK, &mask, &oldmask);
+        if (j + 1 - accepted_parts > allowed)
         {
-            pause(); // Wait for SIGUSR2 from parent
+            long long stall_start = now_ns();
+            STAT_STORE(st->state, STUDENT_SUBMITTED);
+            while (j + 1 - accepted_parts > allowed)
+                trace_sigsuspend(&oldmask); // Wait for SIG_ACCEPT from the teacher
+            STAT_STORE(st->stall_ns, st->stall_ns + now_ns() - stall_start);
         }
-        sigusr2_received = 0; // Reset flag for the next part
+        sigprocmask(SIG_SETMASK, &oldmask, NULL);
     }
 
-    printf("Student [%d, %d] has completed the task!\n", i, getpid());
-    exit(problems);
+    STAT_STORE(st->state, STUDENT_DONE);
+    RLOG(RLOG_INFO, "Student [%ld, %ld] has completed the task!\n", i, getpid());
+    free(submitted_at);
+    exit(EXIT_SUCCESS);
 }
 
-void create_children(int n, int prob, int p, int t)
+// Called with SIG_SUBMIT blocked; oldmask is the mask to wait with when throttled. A limit hit
+// while forking lowers *max_alive for the students still to come.
+void create_children(int n, int prob, int p, int t, int *max_alive, sigset_t *oldmask)
 {
-    switch (fork())
+    pid_t pid;
+    for (;;)
+    {
+        // Admit a new student only when one of the running ones has left
+        while (pool.alive >= *max_alive)
+        {
+            if (pool_reap(&pool, resend_acceptances(), oldmask) == -1 && errno != EINTR)
+                ERR("pool_reap");
+        }
+        pid = pool_fork(&pool);
+        if (pid >= 0)
+            break;
+        if ((errno != EAGAIN && errno != EMFILE) || pool.alive == 0)
+            ERR("Fork:");
+        *max_alive = pool.alive; // Hit RLIMIT_NPROC or RLIMIT_NOFILE, wait for an exit and retry
+    }
+    switch (pid)
     {
         case 0:
-            sethandler(sigusr2_handler, SIGUSR2); // Setup SIGUSR2 handler for the child
+            sethandler(accept_handler, SIG_ACCEPT); // Setup acceptance handler for the child
             child_work(n, prob, p, t);
-            //exit(EXIT_SUCCESS);
-        case -1:
-            perror("Fork:");
-            exit(EXIT_FAILURE);
         default:
-            students[n].pid = getpid();
+            students[n].pid = pid;
     }
 }
 
-void parent_work()
+void teacher_work(int id, int teachers, char **probs, int p, int t, int max_alive, int out_fd)
 {
-    sethandler(sigusr1_handler, SIGUSR1);
-    sethandler(sigchld_handler, SIGCHLD);
+    rlog_attach();
+    trace_name("teacher", id);
+    shard_first = id;
+    shard_step = teachers;
+    pool_free(&pool); // The parent's pool, the teacher's students get one of their own
+    if (pool_init(&pool, (student_count - id + teachers - 1) / teachers) == -1)
+        ERR("pool_init");
+    pool.on_exit = student_exited;
+    unsent_capacity = (student_count - id + teachers - 1) / teachers * (window + 1);
+    unsent = malloc(unsent_capacity * sizeof(acceptance_t));
+    if (unsent == NULL)
+        ERR("malloc");
+
+    sethandler(sigusr1_handler, SIG_SUBMIT);
 
     sigset_t mask, oldmask;
     sigemptyset(&mask);
-    sigaddset(&mask, SIGUSR1);
+    sigaddset(&mask, SIG_SUBMIT);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+
+    int shard_size = 0;
+    for (int i = shard_first; i < student_count; i += shard_step)
+    {
+        students[i].teacher = id;
+        create_children(i, atoi(probs[i]), p, t, &max_alive, &oldmask);
+        shard_size++;
+    }
+
+    // Wait for submissions and exits, the mask lets SIG_SUBMIT in only while waiting
+    while (pool.alive > 0)
+    {
+        if (pool_reap(&pool, resend_acceptances(), &oldmask) == -1 && errno != EINTR)
+            ERR("pool_reap");
+    }
+    free(unsent);
+
+    // Report the shard back to the merging parent
+    teacher_stats_t stats = { id, sigusr1_count, shard_size, total_issues };
+    if (bulk_write(out_fd, (char *)&stats, sizeof(stats)) < 0)
+        ERR("write");
+    for (int i = shard_first; i < student_count; i += shard_step)
+    {
+        if (bulk_write(out_fd, (char *)&students[i], sizeof(student_info_t)) < 0)
+            ERR("write");
+    }
+    close(out_fd);
+    pool_free(&pool);
+}
+
+// Prints what the students cost, from the records their teachers reported
+void report_usage()
+{
+    pool_child_t *rows = calloc(student_count, sizeof(pool_child_t));
+    if (rows == NULL)
+        ERR("calloc");
+    for (int i = 0; i < student_count; i++)
+    {
+        rows[i].pid = students[i].pid;
+        rows[i].pidfd = -1;
+        rows[i].status = students[i].status;
+        rows[i].usage = students[i].usage;
+    }
+    pool_print_usage(stdout, rows, student_count, REPORT_ROWS);
+    if (json_path != NULL && pool_write_usage_json(json_path, rows, student_count) == -1)
+        ERR("pool_write_usage_json");
+    free(rows);
+}
+
+void parent_work(int teachers, char **probs, int p, int t, int max_alive)
+{
+    // One pipe per teacher, so shard reports larger than PIPE_BUF never interleave
+    int *fds = calloc(teachers, sizeof(int));
+    if (fds == NULL)
+        ERR("calloc");
+    if (pool_init(&pool, teachers) == -1)
+        ERR("pool_init");
+
+    for (int id = 0; id < teachers; id++)
+    {
+        int pfd[2];
+        if (pipe(pfd) == -1)
+            ERR("pipe");
+        switch (pool_fork(&pool))
+        {
+            case 0:
+                close(pfd[0]);
+                for (int k = 0; k < id; k++)
+                    close(fds[k]);
+                teacher_work(id, teachers, probs, p, t, max_alive, pfd[1]);
+                free(fds);
+                free(students);
+                exit(EXIT_SUCCESS);
+            case -1:
+                ERR("Fork:");
+        }
+        close(pfd[1]);
+        fds[id] = pfd[0];
+    }
+
+    // SIGUSR1 to the parent prints a live snapshot of the shared statistics
+    sethandler(snapshot_handler, SIGUSR1);
 
-    while (student_count > 0)
+    // Merge per-teacher statistics as the teachers finish
+    teacher_stats_t *stats = calloc(teachers, sizeof(teacher_stats_t));
+    struct pollfd *pfds = calloc(teachers, sizeof(struct pollfd));
+    if (stats == NULL || pfds == NULL)
+        ERR("calloc");
+    for (int k = 0; k < teachers; k++)
+    {
+        pfds[k].fd = fds[k];
+        pfds[k].events = POLLIN;
+    }
+    int pending = teachers;
+    while (pending > 0)
     {
-        sigsuspend(&oldmask); // Wait for signals
-        if (last_signal == SIGUSR1 && sigusr1_sender_pid != 0)
+        if (poll(pfds, teachers, -1) == -1)
         {
-            kill(sigusr1_sender_pid, SIGUSR2); // Send SIGUSR2 to the sender process
-            sigusr1_sender_pid = 0;
+            if (errno != EINTR)
+                ERR("poll");
+            if (snapshot_requested)
+            {
+                snapshot_requested = 0;
+                print_snapshot();
+            }
+            continue;
+        }
+        for (int k = 0; k < teachers; k++)
+        {
+            if (pfds[k].fd < 0 || pfds[k].revents == 0)
+                continue;
+            if (bulk_read(fds[k], (char *)&stats[k], sizeof(teacher_stats_t)) != sizeof(teacher_stats_t))
+                ERR("read");
+            for (int i = k; i < student_count; i += teachers)
+            {
+                if (bulk_read(fds[k], (char *)&students[i], sizeof(student_info_t)) != sizeof(student_info_t))
+                    ERR("read");
+            }
+            total_issues += stats[k].issues;
+            close(fds[k]);
+            pfds[k].fd = -1;
+            pending--;
         }
     }
+    free(pfds);
+    free(fds);
+
+    if (pool_wait_all(&pool) == -1)
+        ERR("pool_wait_all");
+    pool_free(&pool);
+    if (rlog_close() == -1)
+        ERR("rlog_close");
 
     printf("All students have completed their tasks.\n");
-    printf("No. | Student ID | Issue count\n");
+    printf("No. | Student ID | Teacher | Issue count\n");
+    for (int i = 0; i < student_count; i++)
+    {
+        printf("%3d | %10d | %7d | %11d\n", i + 1, students[i].pid, students[i].teacher, students[i].issues);
+    }
+    printf("Teacher | Students | Accepted | Issues\n");
+    int accepted = 0;
+    for (int k = 0; k < teachers; k++)
+    {
+        printf("%7d | %8d | %8d | %6d\n", k, stats[k].students, stats[k].accepted, stats[k].issues);
+        accepted += stats[k].accepted;
+    }
+    printf("Total accepted: %d\n", accepted);
+    printf("Total issues: %d\n", total_issues);
+    print_histograms(p);
+    free(stats);
+    report_usage();
+}
+
+// Discrete-event simulation of the same workload in virtual time
+enum sim_event_type { EV_STEP, EV_ISSUE, EV_SUBMIT, EV_ACCEPT };
+
+typedef struct {
+    long long time; // virtual ms
+    long long seq;  // insertion order breaks ties deterministically
+    int type;
+    int student;
+    int part;            // 0-based part of EV_SUBMIT/EV_ACCEPT
+    long long submitted; // submission time carried by EV_ACCEPT
+} sim_event_t;
+
+typedef struct {
+    sim_event_t *heap;
+    int size;
+    int capacity;
+    long long next_seq;
+} sim_queue_t;
+
+typedef struct {
+    unsigned int rng;
+    int prob;
+    int part;     // part being worked on, equals the number of parts submitted
+    int accepted;
+    int step;
+    int issues;
+    int blocked;  // waiting for acceptances before starting the next part
+    long long part_start;
+    long long blocked_since;
+} sim_student_t;
+
+int sim_before(const sim_event_t *a, const sim_event_t *b)
+{
+    return a->time < b->time || (a->time == b->time && a->seq < b->seq);
+}
+
+void sim_push_part(sim_queue_t *q, long long time, int type, int student, int part, long long submitted)
+{
+    if (q->size == q->capacity)
+    {
+        q->capacity = q->capacity ? 2 * q->capacity : 1024;
+        q->heap = realloc(q->heap, q->capacity * sizeof(sim_event_t));
+        if (q->heap == NULL)
+            ERR("realloc");
+    }
+    sim_event_t ev = { time, q->next_seq++, type, student, part, submitted };
+    int i = q->size++;
+    while (i > 0 && sim_before(&ev, &q->heap[(i - 1) / 2]))
+    {
+        q->heap[i] = q->heap[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    q->heap[i] = ev;
+}
+
+void sim_push(sim_queue_t *q, long long time, int type, int student)
+{
+    sim_push_part(q, time, type, student, 0, 0);
+}
+
+sim_event_t sim_pop(sim_queue_t *q)
+{
+    sim_event_t top = q->heap[0];
+    sim_event_t last = q->heap[--q->size];
+    int i = 0;
+    for (;;)
+    {
+        int c = 2 * i + 1;
+        if (c >= q->size)
+            break;
+        if (c + 1 < q->size && sim_before(&q->heap[c + 1], &q->heap[c]))
+            c++;
+        if (!sim_before(&q->heap[c], &last))
+            break;
+        q->heap[i] = q->heap[c];
+        i = c;
+    }
+    q->heap[i] = last;
+    return top;
+}
+
+void sim_start_part(sim_queue_t *q, sim_student_t *st, student_stats_t *rec, int i, int p, int t, long long now)
+{
+    printf("[%8lld] Student [%d] has started doing part %d of %d!\n", now, i, st->part + 1, p);
+    rec->part = st->part + 1;
+    rec->state = STUDENT_WORKING;
+    st->step = 0;
+    st->part_start = now;
+    if (t > 0)
+        sim_push(q, now + 100LL * t, EV_STEP, i);
+    else
+        sim_push(q, now, EV_SUBMIT, i);
+}
+
+void simulate(int teachers, char **probs, int p, int t, long accept_ms)
+{
+    long long step_ms = 100LL * t; // Same timing as child_work(): t steps of 100*t ms
+    sim_queue_t q = { 0 };
+    sim_student_t *sim = calloc(student_count, sizeof(sim_student_t));
+    long long *teacher_free = calloc(teachers, sizeof(long long));
+    teacher_stats_t *stats = calloc(teachers, sizeof(teacher_stats_t));
+    if (sim == NULL || teacher_free == NULL || stats == NULL)
+        ERR("calloc");
+
+    for (int i = 0; i < student_count; i++)
+    {
+        sim[i].rng = student_seed(i);
+        sim[i].prob = atoi(probs[i]);
+        students[i].pid = i + 1; // Virtual students have no process, number them instead
+        students[i].teacher = i % teachers;
+        stats[i % teachers].teacher = i % teachers;
+        stats[i % teachers].students++;
+        stats_of(i)->pid = i + 1;
+        printf("[%8lld] Student [%d] has started doing task!\n", 0LL, i);
+        if (p > 0)
+            sim_start_part(&q, &sim[i], stats_of(i), i, p, t, 0);
+        else
+            stats_of(i)->state = STUDENT_DONE;
+    }
+
+    long long now = 0;
+    while (q.size > 0)
+    {
+        sim_event_t ev = sim_pop(&q);
+        now = ev.time;
+        int i = ev.student;
+        sim_student_t *st = &sim[i];
+        student_stats_t *rec = stats_of(i);
+        int k = students[i].teacher;
+        switch (ev.type)
+        {
+            case EV_STEP:
+                st->step++;
+                if (rand_r(&st->rng) % 100 < st->prob)
+                {
+                    sim_push(&q, now + 50, EV_ISSUE, i);
+                    break;
+                }
+                // fall through
+            case EV_ISSUE:
+                if (ev.type == EV_ISSUE)
+                {
+                    st->issues++;
+                    rec->issues = st->issues;
+                    printf("[%8lld] Student [%d] has an issue (%d) doing task!\n", now, i, st->issues);
+                }
+                if (st->step < t)
+                {
+                    sim_push(&q, now + step_ms, EV_STEP, i);
+                    break;
+                }
+                // fall through
+            case EV_SUBMIT:
+                printf("[%8lld] Student [%d] has finished part %d of %d!\n", now, i, st->part + 1, p);
+                rec->part_ns[st->part] = (now - st->part_start) * 1000000LL;
+                // A teacher grades one submission at a time
+                if (teacher_free[k] < now)
+                    teacher_free[k] = now;
+                teacher_free[k] += accept_ms;
+                sim_push_part(&q, teacher_free[k], EV_ACCEPT, i, st->part, now);
+                st->part++;
+                if (st->part < p && st->part - st->accepted <= window)
+                    sim_start_part(&q, st, rec, i, p, t, now);
+                else
+                {
+                    st->blocked = 1;
+                    st->blocked_since = now;
+                    rec->state = STUDENT_SUBMITTED;
+                }
+                break;
+            case EV_ACCEPT:
+                printf("[%8lld] Teacher [%d] has accepted part %d of student [%d].\n", now, k, ev.part + 1, i);
+                stats[k].accepted++;
+                rec->accept_wait_ns += (now - ev.submitted) * 1000000LL;
+                rec->parts_done = ++st->accepted;
+                if (!st->blocked)
+                    break;
+                if (st->part < p && st->part - st->accepted <= window)
+                {
+                    st->blocked = 0;
+                    rec->stall_ns += (now - st->blocked_since) * 1000000LL;
+                    sim_start_part(&q, st, rec, i, p, t, now);
+                }
+                else if (st->accepted == p)
+                {
+                    st->blocked = 0;
+                    rec->stall_ns += (now - st->blocked_since) * 1000000LL;
+                    printf("[%8lld] Student [%d] has completed the task!\n", now, i);
+                    rec->state = STUDENT_DONE;
+                    students[i].issues = st->issues;
+                    stats[k].issues += st->issues;
+                    total_issues += st->issues;
+                }
+                break;
+        }
+    }
+
+    printf("All students have completed their tasks in %lld ms of virtual time.\n", now);
+    printf("No. | Student | Teacher | Issue count\n");
     for (int i = 0; i < student_count; i++)
     {
-        printf("%3d | %10d | %11d\n", i + 1, students[i].pid, students[i].issues);
+        printf("%3d | %7d | %7d | %11d\n", i + 1, i, students[i].teacher, students[i].issues);
+    }
+    printf("Teacher | Students | Accepted | Issues\n");
+    int accepted = 0;
+    for (int k = 0; k < teachers; k++)
+    {
+        printf("%7d | %8d | %8d | %6d\n", k, stats[k].students, stats[k].accepted, stats[k].issues);
+        accepted += stats[k].accepted;
     }
+    printf("Total accepted: %d\n", accepted);
     printf("Total issues: %d\n", total_issues);
+    print_histograms(p);
+
+    free(q.heap);
+    free(stats);
+    free(teacher_free);
+    free(sim);
 }
 
 void usage(char *name)
 {
-    fprintf(stderr, "USAGE: %s 0<n\n", name);
+    fprintf(stderr, "USAGE: %s [-T teachers] [-M max_alive] [-W window] [-s seed] [-j json_path] [-L level[:every]]\n"
+                    "\t[-e trace_path] [-V [-a accept_ms]] p t prob...\n",
+            name);
+    fprintf(stderr, "\tp - number of parts, t - time per part (x100 ms)\n");
+    fprintf(stderr, "\tprob - issue probability of each student (0-100)\n");
+    fprintf(stderr, "\tteachers - number of teacher processes (default 1)\n");
+    fprintf(stderr, "\tmax_alive - students running at once (default half of RLIMIT_NPROC)\n");
+    fprintf(stderr, "\twindow - parts awaiting acceptance while working on the next (default 0)\n");
+    fprintf(stderr, "\tseed - seed of the students' issue generators (default from time and PID)\n");
+    fprintf(stderr, "\tjson_path - also write the resource usage of the students there as JSON\n");
+    fprintf(stderr, "\tlevel - 0 logs nothing, 1 only students starting and completing, 2 also parts,\n"
+                    "\t\tissues and acceptances (default); every - log one in every that many of those (default 1)\n");
+    fprintf(stderr, "\ttrace_path - write a Chrome trace of the forks, signals, sleeps, reads and writes there\n");
+    fprintf(stderr, "\t-V - simulate the run in virtual time in one process, without sleeping\n");
+    fprintf(stderr, "\taccept_ms - virtual time a teacher spends accepting one part (default 0)\n");
+    fprintf(stderr, "Send SIGUSR1 to the parent for a live snapshot of all students.\n");
     exit(EXIT_FAILURE);
 }
 
 int main(int argc, char *argv[])
 {
-    if (argc < 4)
+    int teachers = 1;
+    int max_alive = 0;
+    int virtual_time = 0;
+    long accept_ms = 0;
+    int seeded = 0;
+    char *trace_file = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "T:M:W:s:j:L:e:Va:")) != -1)
+    {
+        switch (c)
+        {
+            case 'T':
+                teachers = atoi(optarg);
+                break;
+            case 'M':
+                max_alive = atoi(optarg);
+                if (max_alive <= 0)
+                    usage(argv[0]);
+                break;
+            case 'W':
+                window = atoi(optarg);
+                if (window < 0)
+                    usage(argv[0]);
+                break;
+            case 's':
+                run_seed = strtoul(optarg, NULL, 0);
+                seeded = 1;
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'e':
+                trace_file = optarg;
+                break;
+            case 'L':
+                if (rlog_parse(optarg) == -1)
+                    usage(argv[0]);
+                break;
+            case 'V':
+                virtual_time = 1;
+                break;
+            case 'a':
+                accept_ms = atol(optarg);
+                if (accept_ms < 0)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind < 3 || teachers <= 0)
     {
         usage(argv[0]);
     }
 
-    int p = atoi(argv[1]);
-    int t = atoi(argv[2]);
-    student_count = argc - 3;
+    int p = atoi(argv[optind]);
+    int t = atoi(argv[optind + 1]);
+    char **probs = argv + optind + 2;
+    student_count = argc - optind - 2;
+    if (teachers > student_count)
+        teachers = student_count;
+
+    if (max_alive == 0)
+    {
+        // Leave room under the process limit for the rest of the user's session
+        struct rlimit rl;
+        if (getrlimit(RLIMIT_NPROC, &rl) == -1)
+            ERR("getrlimit");
+        if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur / 2 >= (rlim_t)student_count)
+            max_alive = student_count;
+        else
+            max_alive = rl.rlim_cur / 2;
+    }
+    // The limit is global, every teacher admits its share of it
+    max_alive = max_alive / teachers > 0 ? max_alive / teachers : 1;
 
     students = calloc(student_count, sizeof(student_info_t));
     if (students == NULL)
         ERR("calloc");
 
-    for (int i = 3; i < argc; i++)
+    if (!seeded)
+        run_seed = time(NULL) * getpid();
+    printf("Seed: %u\n", run_seed);
+
+    stats_init(student_count, p);
+    if (virtual_time)
+        simulate(teachers, probs, p, t, accept_ms);
+    else
     {
-        create_children(i - 3, atoi(argv[i]), p, t);
+        if (trace_file != NULL && trace_init(trace_file) == -1)
+            ERR("trace_init");
+        // The collector is forked before anything else, so no other child inherits it
+        if (rlog_init(teachers + student_count + 1) == -1)
+            ERR("rlog_init");
+        parent_work(teachers, probs, p, t, max_alive);
+        if (trace_close() == -1)
+            ERR("trace_close");
     }
 
-    parent_work();
-
+    munmap(stats_region, stats_size);
     free(students);
     printf("Parent quits\n");
     fflush(stdout);
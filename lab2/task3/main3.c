@@ -1,21 +1,135 @@
+#define _GNU_SOURCE
 #include <errno.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
 #include <sys/wait.h>
 #include <time.h>
+#include <ucontext.h>
+#ifdef __SANITIZE_ADDRESS__
+#include <sanitizer/asan_interface.h>
+#endif
 #include <unistd.h>
 #include <signal.h>
 
+#include "../common/pool.h"
+#include "../common/rlog.h"
+
 #define ERR(source) \
     (fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), perror(source), kill(0, SIGKILL), exit(EXIT_FAILURE))
 
+enum sched_policy { POLICY_RR, POLICY_WFQ, POLICY_PRIO };
+enum pause_mode { PAUSE_COOP, PAUSE_STOP };
+enum backend { BACKEND_PROCESS, BACKEND_COROUTINE };
+enum coroutine_state { CO_IDLE, CO_SLEEPING, CO_READY };
+
+typedef struct {
+    pid_t pid;
+    int weight;          // share under wfq, priority under prio (higher wins)
+    int switches;        // times the child was switched in
+    long long run_ns;    // total time spent as the working child
+    long long last_start;
+    int slot;            // slot the child is running in, -1 while paused
+    long long last_switch; // when the child was last paused or resumed
+    long long seen_counter; // counter at the previous dashboard
+    int reaped;
+    int removed;         // removed over the control socket, never scheduled again
+    int removing;        // removed, but the process has not exited yet
+    long long remove_deadline; // when a removed child that has not exited gets SIGKILL, 0 once sent
+} child_info_t;
+
+#define CACHE_LINE 64
+#define SPARE_CHILDREN 1024  // counter slots reserved for children added over the control socket
+#define CONTROL_CLIENTS 8
+#define CONTROL_BUFFER 4096
+#define CO_STACK_SIZE (256 * 1024) // stack all coroutines run on
+#define CO_STACK_SLACK 256           // saved below the deepest frame seen at a switch
+#define WHEEL_SLOTS 1024     // one slot per millisecond tick, longer sleeps wait extra rounds
+#define REPORT_ROWS 1000     // rows of the report and dashboard, the rest is summarized
+
+// Live counter of one child in shared memory, written only by that child
+typedef struct {
+    long long counter;
+    long long last_iteration; // CLOCK_MONOTONIC ns of the latest iteration
+} __attribute__((aligned(CACHE_LINE))) counter_slot_t;
+
+// Connection to the control socket with its unfinished command line
+typedef struct {
+    int fd;              // -1 if the entry is free
+    int len;
+    char buf[CONTROL_BUFFER];
+} control_client_t;
+
+// Worker of the coroutine backend; it only ever yields while sleeping
+typedef struct coroutine {
+    ucontext_t *ctx;     // NULL until the first run
+    char *saved;         // used part of the shared stack while the coroutine is switched out
+    char *low;           // lowest address of the shared stack it needs back
+    int saved_len, saved_cap;
+    struct coroutine *prev, *next; // wheel slot or ready queue the coroutine is in
+    long long wake_tick;
+    long long left_ticks; // rest of the sleep while paused
+    int state;
+    int index;
+} coroutine_t;
+
+typedef struct {
+    coroutine_t head;    // sentinel of a circular list
+} co_list_t;
+
+typedef struct {
+    int count;
+    long long sum_ns;
+    long long max_ns;
+} latency_t;
+
 volatile sig_atomic_t start_work = 0;  // Controls start/resume of work
-pid_t *child_pids;
+child_info_t *children;
 int child_count;
-int current_child = -1; // Tracks the current working child
+int live_count;         // children not removed yet
+int counter_capacity;   // children the shared counters have room for
+// Gang scheduling: up to active_count children run at once, one per slot
+int active_count = 1;
+int *slot_child;        // child running in each slot, -1 if the slot is free
+int pin_slots = 0;      // pin the child of slot s to the allowed CPU s modulo their count
+cpu_set_t cpu_mask;     // CPUs the parent may run on at startup, which cpusets and taskset narrow
+int cpu_count = 1;      // CPUs in cpu_mask
+int rotation = 0;       // where the next round of selection starts
 volatile sig_atomic_t keep_working = 1; // Controls the child loop
-volatile sig_atomic_t last_signal = 0; // Tracks the last signal received
+volatile sig_atomic_t rotate_requested = 0; // Set by SIGUSR1 sent to the parent
+volatile sig_atomic_t dump_requested = 0; // Set by SIGQUIT sent to the parent
+counter_slot_t *counters;
+int print_iterations = 1;
+long long last_dashboard;
+pid_t child_pgid = 0;   // children live in their own process group, led by the first child
+long long sched_start;
+int pause_mode = PAUSE_COOP;
+latency_t pause_latency;   // from the pause request until the child is known to be paused
+latency_t handoff_latency; // from the pause request until the next child is known to run
+int sched_policy = POLICY_RR;
+int quantum_ms = 0;
+int sched_fd = -1;      // quantum timer, disarmed while quantum_ms is 0
+int held = 0;           // set by the pause command, no rotation happens until resume or switch
+int control_fd = -1;    // listening control socket, -1 if disabled
+int grace_ms = 1000;    // time children get to stop on SIGTERM before SIGKILL
+control_client_t control_clients[CONTROL_CLIENTS];
+pool_t pool;            // child processes in index order, reaped through their pidfds
+int backend = BACKEND_PROCESS;
+coroutine_t *coroutines;
+co_list_t wheel[WHEEL_SLOTS];
+co_list_t ready;
+long long wheel_tick = 0; // ticks since sched_start processed by the wheel
+ucontext_t scheduler_ctx;
+char *co_stack;           // shared by the coroutines, each one's frames are copied out when it switches
+coroutine_t *current;     // coroutine being run, NULL in the scheduler
 
 void sethandler(void (*f)(int), int sigNo)
 {
@@ -26,165 +140,1316 @@ void sethandler(void (*f)(int), int sigNo)
         ERR("sigaction");
 }
 
-void sigusr1_handler(int sig)
+long long now_ns()
 {
-    // Ensure the child array is valid
-    if (child_count <= 0 || child_pids == NULL)
-    {
-        printf("Error: No child processes available.\n");
-        return;
-    }
-
-    if (current_child != -1)
-    {
-        // Pause the currently working child
-        kill(child_pids[current_child], SIGUSR2);
-        printf("Parent paused child %d (PID %d)\n", current_child, child_pids[current_child]);
-    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-    // Move to the next child
-    current_child = (current_child + 1) % child_count;
+void sigusr1_handler(int sig)
+{
+    trace_signal(sig, 0);
+    rotate_requested = 1; // Rotation is done by the main loop, outside signal context
+}
 
-    // Start the next child
-    kill(child_pids[current_child], SIGUSR1);
-    printf("Parent started child %d (PID %d)\n", current_child, child_pids[current_child]);
+void sigquit_handler(int sig)
+{
+    trace_signal(sig, 0);
+    dump_requested = 1;
 }
 
 void sigusr2_handler(int sig)
 {
+    trace_signal(sig, 0);
     start_work = 0; // Stop child from working
 }
 
 void sigusr1_child_handler(int sig)
 {
+    trace_signal(sig, 0);
     start_work = 1; // Allow child to start working
 }
 
 void sigint_child_handler(int sig)
 {
+    trace_signal(sig, 0);
     start_work = 0; // Stop child from working
     keep_working = 0; // Signal termination
 }
 
-void cleanup_children()
+// Finishes the removal of child i once it is reaped
+void child_removed(int i)
 {
-    printf("Cleaning up children...\n");
-    for (int i = 0; i < child_count; i++)
+    children[i].removing = 0;
+    // Drop the acknowledgement the child sends on its way out
+    sigset_t ack;
+    sigemptyset(&ack);
+    sigaddset(&ack, SIGUSR2);
+    struct timespec zero = { 0, 0 };
+    while (sigtimedwait(&ack, NULL, &zero) > 0)
+        ;
+    if (--live_count == 0)
+        child_pgid = 0; // The group died with its last member, the next child starts a new one
+    printf("Parent removed child %d (PID %d)\n", i, children[i].pid);
+}
+
+void child_reaped(pool_t *pool, int index)
+{
+    children[index].reaped = 1;
+    if (children[index].removing)
+        child_removed(index);
+}
+
+// Reaps exited children until none are left or the deadline passes; returns how many remain
+int reap_until(long long deadline)
+{
+    while (pool.alive > 0)
     {
-        if (kill(child_pids[i], SIGINT) == -1)
+        long long left = deadline - now_ns();
+        if (left <= 0)
+            break;
+        if (pool_reap(&pool, (left + 999999) / 1000000, NULL) == -1 && errno != EINTR)
+            ERR("pool_reap");
+    }
+    return pool.alive;
+}
+
+// Stops all children: one SIGTERM to their process group, a grace period, then SIGKILL per straggler
+void shutdown_children(int grace_ms)
+{
+    long long start = now_ns();
+    printf("Shutting down %d children...\n", live_count);
+    fflush(stdout);
+
+    // The group is gone once every child was removed over the control socket
+    if (child_pgid != 0)
+    {
+        if (trace_kill(-child_pgid, SIGTERM) == -1 && errno != ESRCH)
+            ERR("kill");
+        if (pause_mode == PAUSE_STOP)
+            trace_kill(-child_pgid, SIGCONT); // Stopped children handle SIGTERM only once continued
+    }
+
+    int remaining = reap_until(start + grace_ms * 1000000LL);
+    int killed = 0;
+    if (remaining > 0)
+    {
+        for (int i = 0; i < child_count; i++)
         {
-            if (errno != ESRCH)
-                ERR("kill");
+            if (children[i].reaped)
+                continue;
+            printf("Child %d (PID %d) did not stop in %d ms, killing it\n", i, children[i].pid, grace_ms);
+            trace_kill(children[i].pid, SIGKILL);
+            killed++;
         }
+        remaining = reap_until(now_ns() + 1000000000LL);
     }
-
-    while (wait(NULL) > 0 || errno == EINTR)
-        ; // Wait for all children to terminate
+    printf("Shutdown took %.1f ms (%d killed, %d not reaped)\n", (now_ns() - start) / 1e6, killed, remaining);
 }
 
 void sigint_handler(int sig)
 {
-    printf("Parent received SIGINT.\n");
-    cleanup_children();
-    keep_working = 0; // Signal termination
-    //printf("%d\n", keep_working);
+    trace_signal(sig, 0);
+    keep_working = 0; // The main loop shuts the children down outside signal context
+}
+
+// Charges the working children for the time they have run so far
+void account_running()
+{
+    long long now = now_ns();
+    for (int s = 0; s < active_count; s++)
+    {
+        int i = slot_child[s];
+        if (i == -1)
+            continue;
+        children[i].run_ns += now - children[i].last_start;
+        children[i].last_start = now;
+    }
+}
+
+int *select_order; // rotation position of every child, used as the tie breaker
+int select_policy;
+// Buffers of the selection, grown with the children instead of allocated every quantum
+int *candidates;
+char *run_buffer;
+int select_capacity = 0;
+
+void reserve_select(int n)
+{
+    if (n <= select_capacity)
+        return;
+    candidates = realloc(candidates, n * sizeof(int));
+    select_order = realloc(select_order, n * sizeof(int));
+    run_buffer = realloc(run_buffer, n);
+    if (candidates == NULL || select_order == NULL || run_buffer == NULL)
+        ERR("realloc");
+    select_capacity = n;
+}
+
+int compare_candidates(const void *a, const void *b)
+{
+    const child_info_t *x = &children[*(const int *)a];
+    const child_info_t *y = &children[*(const int *)b];
+    if (select_policy == POLICY_WFQ)
+    {
+        // Smallest run time per unit of weight first
+        long long l = x->run_ns * y->weight, r = y->run_ns * x->weight;
+        if (l != r)
+            return l < r ? -1 : 1;
+    }
+    else if (select_policy == POLICY_PRIO && x->weight != y->weight)
+        return x->weight > y->weight ? -1 : 1; // Highest priority first
+    return select_order[*(const int *)a] - select_order[*(const int *)b];
+}
+
+// Marks in run[] the children to run for the next quantum
+void pick_next(int policy, char *run)
+{
+    account_running();
+    reserve_select(child_count);
+    // Equal candidates are taken in rotation order, which makes rr and ties round robin
+    int m = 0;
+    for (int k = 0; k < child_count; k++)
+    {
+        int i = (rotation + k) % child_count;
+        select_order[i] = k;
+        run[i] = 0;
+        if (!children[i].removed)
+            candidates[m++] = i;
+    }
+    select_policy = policy;
+    if (policy != POLICY_RR)
+        qsort(candidates, m, sizeof(int), compare_candidates);
+
+    int n = active_count < m ? active_count : m;
+    for (int k = 0; k < n; k++)
+        run[candidates[k]] = 1;
+    // Round robin continues after the last child taken, skipping removed ones
+    if (policy == POLICY_RR && n > 0)
+        rotation = (candidates[n - 1] + 1) % child_count;
+    else
+        rotation = (rotation + n) % child_count;
+}
+
+void record_latency(latency_t *l, long long ns)
+{
+    l->count++;
+    l->sum_ns += ns;
+    if (ns > l->max_ns)
+        l->max_ns = ns;
+}
+
+// Waits for the state change of child i selected by options (WSTOPPED or WCONTINUED), or for
+// its exit, which is left for the pool to reap
+int wait_state(int i, int options)
+{
+    siginfo_t info;
+    while (waitid(P_PIDFD, pool.children[i].pidfd, &info, options | WEXITED | WNOWAIT) == -1)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+    return 0;
+}
+
+void co_list_init(co_list_t *l)
+{
+    l->head.prev = l->head.next = &l->head;
+}
+
+void co_list_push(co_list_t *l, coroutine_t *co)
+{
+    co->prev = l->head.prev;
+    co->next = &l->head;
+    l->head.prev->next = co;
+    l->head.prev = co;
+}
+
+void co_list_unlink(coroutine_t *co)
+{
+    co->prev->next = co->next;
+    co->next->prev = co->prev;
+    co->prev = co->next = NULL;
+}
+
+void co_wheel_insert(coroutine_t *co)
+{
+    co->state = CO_SLEEPING;
+    co_list_push(&wheel[co->wake_tick & (WHEEL_SLOTS - 1)], co);
+}
+
+void co_make_ready(coroutine_t *co)
+{
+    co->state = CO_READY;
+    co_list_push(&ready, co);
+}
+
+// Kept out of line so its frame lies below everything the coroutine has on the stack
+__attribute__((noinline)) void co_switch_out(coroutine_t *co)
+{
+    co->low = (char *)__builtin_frame_address(0) - CO_STACK_SLACK;
+    swapcontext(co->ctx, &scheduler_ctx);
+}
+
+// Called in a coroutine: queues it on the timer wheel and switches back to the scheduler
+void co_sleep(int ms)
+{
+    coroutine_t *co = current;
+    co->wake_tick = wheel_tick + (ms > 0 ? ms : 1);
+    co_wheel_insert(co);
+    co_switch_out(co);
+}
+
+// The shared stack is reused by every coroutine, so frames poisoned by one must not trip up the next
+void co_unpoison_stack()
+{
+#ifdef __SANITIZE_ADDRESS__
+    __asan_unpoison_memory_region(co_stack, CO_STACK_SIZE);
+#endif
+}
+
+void coroutine_work(int i)
+{
+    long long counter = 0;
+    unsigned int seed = time(NULL) ^ (i * 2654435761u);
+    while (1)
+    {
+        co_sleep(100 + rand_r(&seed) % (200 - 100 + 1)); // Random time between 100 and 200 milliseconds
+        counter++;
+        counters[i].counter = counter;
+        counters[i].last_iteration = now_ns();
+        if (print_iterations)
+            RLOG(RLOG_DEBUG, "Child %ld: Counter %ld\n", i, counter);
+    }
+}
+
+// Sets up coroutines from..to-1; they get a context only once first run
+void create_coroutines(int from, int to)
+{
+    for (int i = from; i < to; i++)
+    {
+        coroutine_t *co = &coroutines[i];
+        memset(co, 0, sizeof(coroutine_t));
+        co->index = i;
+        children[i].pid = getpid();
+        live_count++;
+    }
+}
+
+// Moves every coroutine whose sleep ends by now from the wheel to the ready queue
+void co_advance_wheel()
+{
+    long long target = (now_ns() - sched_start) / 1000000LL;
+    // After a long stall one pass over every slot covers all the missed ticks
+    if (target - wheel_tick > WHEEL_SLOTS)
+        wheel_tick = target - WHEEL_SLOTS;
+    while (wheel_tick < target)
+    {
+        wheel_tick++;
+        co_list_t *slot = &wheel[wheel_tick & (WHEEL_SLOTS - 1)];
+        coroutine_t *co = slot->head.next;
+        while (co != &slot->head)
+        {
+            coroutine_t *next = co->next;
+            if (co->wake_tick <= target)
+            {
+                co_list_unlink(co);
+                co_make_ready(co);
+            }
+            co = next;
+        }
+    }
+}
+
+// Runs every ready coroutine until it sleeps again
+void co_run_ready()
+{
+    while (ready.head.next != &ready.head && keep_working)
+    {
+        coroutine_t *co = ready.head.next;
+        co_list_unlink(co);
+        co->state = CO_IDLE;
+        current = co;
+        co_unpoison_stack();
+        if (co->saved_len > 0)
+            memcpy(co_stack + CO_STACK_SIZE - co->saved_len, co->saved, co->saved_len);
+        swapcontext(&scheduler_ctx, co->ctx);
+        current = NULL;
+
+        // Back in the scheduler's own stack, keep only what the coroutine uses of the shared one
+        co_unpoison_stack();
+        co->saved_len = co_stack + CO_STACK_SIZE - co->low;
+        if (co->saved_len > co->saved_cap)
+        {
+            co->saved = realloc(co->saved, co->saved_len);
+            if (co->saved == NULL)
+                ERR("realloc");
+            co->saved_cap = co->saved_len;
+        }
+        memcpy(co->saved, co->low, co->saved_len);
+    }
+}
+
+void co_pause(int i)
+{
+    coroutine_t *co = &coroutines[i];
+    if (co->state == CO_IDLE)
+        return;
+    co->left_ticks = co->state == CO_SLEEPING ? co->wake_tick - wheel_tick : 0;
+    co_list_unlink(co);
+    co->state = CO_IDLE;
+}
+
+void co_resume(int i)
+{
+    coroutine_t *co = &coroutines[i];
+    if (co->state != CO_IDLE)
+        return;
+    if (co->ctx == NULL)
+    {
+        co->ctx = malloc(sizeof(ucontext_t));
+        if (co->ctx == NULL)
+            ERR("malloc");
+        if (getcontext(co->ctx) == -1)
+            ERR("getcontext");
+        co->ctx->uc_stack.ss_sp = co_stack;
+        co->ctx->uc_stack.ss_size = CO_STACK_SIZE;
+        co->ctx->uc_link = NULL; // coroutine_work never returns
+        makecontext(co->ctx, (void (*)(void))coroutine_work, 1, i);
+        co_make_ready(co);
+        return;
+    }
+    if (co->left_ticks > 0)
+    {
+        co->wake_tick = wheel_tick + co->left_ticks;
+        co_wheel_insert(co);
+    }
+    else
+        co_make_ready(co);
+}
+
+// Returns once the child is known to be paused
+void pause_child(int i)
+{
+    if (backend == BACKEND_COROUTINE)
+    {
+        co_pause(i);
+        return;
+    }
+    if (children[i].reaped)
+        return; // Exited on its own, its PID may belong to another process by now
+    pid_t pid = children[i].pid;
+    if (pause_mode == PAUSE_STOP && trace_kill(pid, SIGSTOP) == 0 && wait_state(i, WSTOPPED) == 0)
+        return;
+
+    // Cooperative fallback: clear the child's flag and wait until it acknowledges with SIGUSR2
+    long long start = trace_now();
+    trace_kill(pid, SIGUSR2);
+    sigset_t ack;
+    sigemptyset(&ack);
+    sigaddset(&ack, SIGUSR2);
+    struct timespec timeout = { 1, 0 };
+    siginfo_t info;
+    int sig;
+    do
+    {
+        sig = sigtimedwait(&ack, &info, &timeout);
+        if (sig > 0)
+            trace_signal(sig, info.si_pid);
+    }
+    while ((sig == SIGUSR2 && info.si_pid != pid) || (sig == -1 && errno == EINTR));
+    trace_span("pause handshake", start, "child", pid, "acknowledged", sig == SIGUSR2);
+}
+
+void resume_child(int i)
+{
+    if (backend == BACKEND_COROUTINE)
+    {
+        co_resume(i);
+        return;
+    }
+    if (children[i].reaped)
+        return;
+    pid_t pid = children[i].pid;
+    if (pause_mode == PAUSE_STOP && trace_kill(pid, SIGCONT) == 0)
+        wait_state(i, WCONTINUED);
+    trace_kill(pid, SIGUSR1); // Sets the cooperative flag in both modes
+}
+
+// Pins child i to the CPU of slot s; a child left unpinned still runs, so failing only warns
+void pin_to_slot(int i, int s)
+{
+    int nth = s % cpu_count, cpu = 0;
+    while (!CPU_ISSET(cpu, &cpu_mask) || nth-- > 0)
+        cpu++;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(children[i].pid, sizeof(set), &set) == -1 && errno != ESRCH)
+        fprintf(stderr, "Cannot pin child %d to CPU %d: %s\n", i, cpu, strerror(errno));
+}
+
+// Pauses every running child outside run[] before resuming the selected ones in the freed slots;
+// returns how many children were started
+int apply_run(char *run)
+{
+    long long now = now_ns();
+    int paused = 0;
+    for (int s = 0; s < active_count; s++)
+    {
+        int i = slot_child[s];
+        if (i == -1 || run[i])
+            continue;
+        long long start = now_ns();
+        pause_child(i);
+        record_latency(&pause_latency, now_ns() - start);
+        children[i].run_ns += now_ns() - children[i].last_start;
+        children[i].last_switch = now_ns();
+        children[i].slot = -1;
+        slot_child[s] = -1;
+        paused++;
+        RLOG(RLOG_INFO, "Parent paused child %ld (PID %ld)\n", i, children[i].pid);
+    }
+
+    int s = 0, started = 0;
+    for (int i = 0; i < child_count; i++)
+    {
+        if (!run[i] || children[i].slot != -1 || children[i].removed)
+            continue;
+        while (s < active_count && slot_child[s] != -1)
+            s++;
+        if (s == active_count)
+            break;
+        slot_child[s] = i;
+        children[i].slot = s;
+        if (pin_slots && backend == BACKEND_PROCESS)
+            pin_to_slot(i, s);
+        children[i].last_start = now_ns();
+        children[i].last_switch = children[i].last_start;
+        children[i].switches++;
+        resume_child(i);
+        RLOG(RLOG_INFO, "Parent started child %ld (PID %ld) in slot %ld\n", i, children[i].pid, s);
+        started++;
+    }
+    if (paused > 0)
+        record_latency(&handoff_latency, now_ns() - now);
+    return started;
+}
+
+void reschedule(int policy)
+{
+    reserve_select(child_count);
+    pick_next(policy, run_buffer);
+    apply_run(run_buffer);
+}
+
+void print_sched_report()
+{
+    long long total = now_ns() - sched_start;
+    account_running();
+
+    printf("Child |    PID | Weight | Switches |   Run ms | Share %% |  Wait ms\n");
+    for (int i = 0; i < child_count && i < REPORT_ROWS; i++)
+    {
+        printf("%5d | %6d | %6d | %8d | %8.1f | %7.1f | %8.1f\n", i, children[i].pid, children[i].weight,
+               children[i].switches, children[i].run_ns / 1e6, total > 0 ? 100.0 * children[i].run_ns / total : 0.0,
+               (total - children[i].run_ns) / 1e6);
+    }
+    if (child_count > REPORT_ROWS)
+        printf("... %d more children\n", child_count - REPORT_ROWS);
+    printf("Mode: %s, %d of %d children active\n",
+           backend == BACKEND_COROUTINE ? "coroutines" : pause_mode == PAUSE_STOP ? "stop" : "coop",
+           active_count < child_count ? active_count : child_count, child_count);
+    if (pause_latency.count > 0)
+        printf("Pause latency:   avg %.3f ms, max %.3f ms over %d switches\n",
+               pause_latency.sum_ns / 1e6 / pause_latency.count, pause_latency.max_ns / 1e6, pause_latency.count);
+    if (handoff_latency.count > 0)
+        printf("Handoff latency: avg %.3f ms, max %.3f ms over %d switches\n",
+               handoff_latency.sum_ns / 1e6 / handoff_latency.count, handoff_latency.max_ns / 1e6,
+               handoff_latency.count);
+}
+
+// Iterations per second since the previous dashboard, state, time since the last switch and
+// since the last iteration, which keeps growing for an active child that stalls
+void print_dashboard()
+{
+    long long now = now_ns();
+    double elapsed = (now - last_dashboard) / 1e9;
+    long long rest = 0; // iterations of the children beyond the printed rows
+    printf("Child |    PID | State  |  Counter |  Iter/s | Since switch ms | Since iter ms\n");
+    for (int i = 0; i < child_count; i++)
+    {
+        long long counter = __atomic_load_n(&counters[i].counter, __ATOMIC_RELAXED);
+        if (i >= REPORT_ROWS)
+        {
+            rest += counter - children[i].seen_counter;
+            children[i].seen_counter = counter;
+            continue;
+        }
+        long long last_iteration = __atomic_load_n(&counters[i].last_iteration, __ATOMIC_RELAXED);
+        printf("%5d | %6d | %-6s | %8lld | %7.2f | %15.1f | %13.1f\n", i, children[i].pid,
+               children[i].removed ? "gone" : children[i].slot != -1 ? "active" : "paused", counter,
+               elapsed > 0 ? (counter - children[i].seen_counter) / elapsed : 0.0,
+               children[i].last_switch ? (now - children[i].last_switch) / 1e6 : (now - sched_start) / 1e6,
+               (now - (last_iteration ? last_iteration : sched_start)) / 1e6);
+        children[i].seen_counter = counter;
+    }
+    if (child_count > REPORT_ROWS)
+        printf("... %d more children | %7.2f iter/s together\n", child_count - REPORT_ROWS,
+               elapsed > 0 ? rest / elapsed : 0.0);
+    last_dashboard = now;
+    fflush(stdout);
 }
 
 void child_work(int i)
 {
-    int counter = 0;
+    long long counter = 0;
+    trace_name("child", i);
     srand(time(NULL) * getpid());
 
     sethandler(sigusr1_child_handler, SIGUSR1);
     sethandler(sigusr2_handler, SIGUSR2);
     sethandler(sigint_child_handler, SIGINT);
+    sethandler(sigint_child_handler, SIGTERM);
+    signal(SIGQUIT, SIG_IGN); // Dashboard requests from the terminal are for the parent only
 
-    printf("Child %d (PID %d) ready to start...\n", i, getpid());
+    RLOG(RLOG_INFO, "Child %ld (PID %ld) ready to start...\n", i, getpid());
 
     sigset_t mask, oldmask;
     sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR2);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL); // Blocked in the parent for acknowledgements
+    sigemptyset(&mask);
     sigaddset(&mask, SIGUSR1);
     sigprocmask(SIG_BLOCK, &mask, &oldmask);
 
+    // In stop mode the parent holds every child stopped until it is scheduled
+    if (pause_mode == PAUSE_STOP)
+        raise(SIGSTOP);
+
     while (1)
     {
         if(keep_working == 0)
             break;
         // Wait for the signal to start or resume work
-        while (last_signal!=SIGUSR1)
-            sigsuspend(&oldmask);
+        while (!start_work && keep_working)
+            trace_sigsuspend(&oldmask);
 
         // Main work loop
-        while (start_work)
+        while (start_work && keep_working)
         {
             int t = 100 + rand() % (200 - 100 + 1); // Random time between 100 and 200 milliseconds
             struct timespec req;
             req.tv_sec = t / 1000;
             req.tv_nsec = (t % 1000) * 1000000L;
-            nanosleep(&req, NULL);
+            trace_nanosleep(&req, NULL);
             counter++;
-            printf("Child %d: Counter %d\n", i, counter);
+            __atomic_store_n(&counters[i].counter, counter, __ATOMIC_RELAXED);
+            __atomic_store_n(&counters[i].last_iteration, now_ns(), __ATOMIC_RELAXED);
+            if (print_iterations)
+                RLOG(RLOG_DEBUG, "Child %ld: Counter %ld\n", i, counter);
         }
-        printf("Child %d paused.\n", i);
+        RLOG(RLOG_INFO, "Child %ld paused.\n", i);
+        trace_kill(getppid(), SIGUSR2); // Acknowledge the cooperative pause
+    }
+    RLOG(RLOG_INFO, "Child %ld quits.\n", i);
+}
+
+void close_control()
+{
+    for (int k = 0; k < CONTROL_CLIENTS; k++)
+    {
+        if (control_clients[k].fd != -1)
+            close(control_clients[k].fd);
+        control_clients[k].fd = -1;
     }
-    printf("Child %d quits.\n", i);
+    if (control_fd != -1)
+        close(control_fd);
+    control_fd = -1;
 }
 
-void create_children(int n)
+// Creates children from..to-1 of the children array
+void create_children(int from, int to)
 {
-    for (int i = 0; i < n; i++)
+    if (backend == BACKEND_COROUTINE)
+    {
+        create_coroutines(from, to);
+        return;
+    }
+    fflush(stdout); // Children must not inherit output the parent has not written yet
+    for (int i = from; i < to; i++)
     {
-        pid_t pid = fork();
+        pid_t pid = pool_fork(&pool);
         if (pid < 0)
             ERR("Fork:");
         if (pid == 0)
         {
+            rlog_attach();
+            close_control(); // Only the parent serves the control socket
+            // Join the children's group and never outlive the parent
+            setpgid(0, child_pgid);
+            prctl(PR_SET_PDEATHSIG, SIGTERM);
             child_work(i);
             exit(EXIT_SUCCESS); // Exit child process
         }
-        child_pids[i] = pid;
+        children[i].pid = pid;
+        // Set on both sides of fork, so the group exists whichever runs first
+        if (setpgid(pid, child_pgid) == -1 && errno != EACCES && errno != ESRCH)
+            ERR("setpgid");
+        if (child_pgid == 0)
+            child_pgid = pid;
+        live_count++;
+        if (pause_mode == PAUSE_STOP && wait_state(i, WSTOPPED) == -1)
+            ERR("waitpid");
     }
 }
 
-void usage(char *name)
+void set_quantum(int ms)
 {
-    fprintf(stderr, "USAGE: %s <number_of_children>\n", name);
-    exit(EXIT_FAILURE);
+    struct itimerspec its;
+    its.it_value.tv_sec = ms / 1000;
+    its.it_value.tv_nsec = (ms % 1000) * 1000000L;
+    its.it_interval = its.it_value;
+    if (timerfd_settime(sched_fd, 0, &its, NULL) == -1)
+        ERR("timerfd_settime");
+    quantum_ms = ms;
+}
+
+// Appends n paused children; returns the index of the first one or -1 if there is no room
+int add_children(int n)
+{
+    if (n <= 0 || child_count + n > counter_capacity)
+        return -1;
+    child_info_t *grown = realloc(children, (child_count + n) * sizeof(child_info_t));
+    if (grown == NULL)
+        ERR("realloc");
+    children = grown;
+    memset(children + child_count, 0, n * sizeof(child_info_t));
+    for (int i = child_count; i < child_count + n; i++)
+    {
+        children[i].slot = -1;
+        children[i].weight = 1;
+    }
+    int first = child_count;
+    create_children(first, first + n);
+    child_count += n;
+    return first;
+}
+
+// Terminates child i, keeping its index so the others do not move; the scheduler loop reaps it
+void remove_child(int i)
+{
+    int s = children[i].slot;
+    if (s != -1)
+    {
+        children[i].run_ns += now_ns() - children[i].last_start;
+        slot_child[s] = -1;
+        children[i].slot = -1;
+    }
+    if (backend == BACKEND_COROUTINE)
+    {
+        co_pause(i); // The coroutine is never run again, its context is freed at exit
+        children[i].removed = 1;
+        live_count--;
+        printf("Parent removed child %d\n", i);
+        return;
+    }
+    children[i].removed = 1;
+    children[i].last_switch = now_ns();
+    if (children[i].reaped)
+    {
+        child_removed(i); // Exited on its own already
+        return;
+    }
+    trace_kill(children[i].pid, SIGTERM);
+    if (pause_mode == PAUSE_STOP)
+        trace_kill(children[i].pid, SIGCONT);
+    // The scheduler loop reaps it, so a child slow to stop holds up nobody
+    children[i].removing = 1;
+    children[i].remove_deadline = now_ns() + grace_ms * 1000000LL;
+}
+
+// Kills the removed children that outlived the grace period; returns the time until the next
+// deadline in ms, -1 if no removal is pending
+int expire_removals()
+{
+    long long now = now_ns(), next = -1;
+    for (int i = 0; i < child_count; i++)
+    {
+        if (!children[i].removing || children[i].remove_deadline == 0)
+            continue;
+        if (children[i].remove_deadline <= now)
+        {
+            printf("Child %d (PID %d) did not stop in %d ms, killing it\n", i, children[i].pid, grace_ms);
+            trace_kill(children[i].pid, SIGKILL);
+            children[i].remove_deadline = 0;
+        }
+        else if (next == -1 || children[i].remove_deadline < next)
+            next = children[i].remove_deadline;
+    }
+    return next == -1 ? -1 : (next - now + 999999) / 1000000;
 }
 
+// Runs one control command, writing its reply to out; every reply ends with an "ok" or "error" line
+void run_command(char *line, FILE *out)
+{
+    char *cmd = strtok(line, " \t\r");
+    char *arg = strtok(NULL, " \t\r");
+    if (cmd == NULL)
+        return;
+    if (strcmp(cmd, "switch") == 0 || strcmp(cmd, "remove") == 0)
+    {
+        int i = arg ? atoi(arg) : -1;
+        if (i < 0 || i >= child_count || children[i].removed)
+        {
+            fprintf(out, "error no child %s\n", arg ? arg : "");
+            return;
+        }
+        if (cmd[0] == 'r')
+            remove_child(i);
+        else
+        {
+            char *run = calloc(child_count, 1);
+            if (run == NULL)
+                ERR("calloc");
+            run[i] = 1;
+            held = 0;
+            apply_run(run);
+            free(run);
+        }
+        fprintf(out, "ok\n");
+    }
+    else if (strcmp(cmd, "pause") == 0)
+    {
+        char *run = calloc(child_count, 1);
+        if (run == NULL)
+            ERR("calloc");
+        held = 1;
+        apply_run(run);
+        free(run);
+        fprintf(out, "ok\n");
+    }
+    else if (strcmp(cmd, "resume") == 0)
+    {
+        // Resumes the listed children into the free slots, keeping the running ones
+        char *run = calloc(child_count, 1);
+        if (run == NULL)
+            ERR("calloc");
+        for (int i = 0; i < child_count; i++)
+            run[i] = children[i].slot != -1;
+        for (; arg != NULL; arg = strtok(NULL, " \t\r"))
+        {
+            int i = atoi(arg);
+            if (i >= 0 && i < child_count)
+                run[i] = 1;
+        }
+        held = 0;
+        fprintf(out, "ok %d resumed\n", apply_run(run));
+        free(run);
+    }
+    else if (strcmp(cmd, "quantum") == 0)
+    {
+        int ms = arg ? atoi(arg) : -1;
+        if (ms < 0)
+        {
+            fprintf(out, "error bad quantum\n");
+            return;
+        }
+        set_quantum(ms); // 0 leaves rotation to SIGUSR1 and the rotate command
+        fprintf(out, "ok\n");
+    }
+    else if (strcmp(cmd, "add") == 0)
+    {
+        int n = arg ? atoi(arg) : 1;
+        int first = add_children(n);
+        if (first == -1)
+            fprintf(out, "error cannot add %d children\n", n);
+        else
+            fprintf(out, "ok %d..%d\n", first, first + n - 1);
+    }
+    else if (strcmp(cmd, "rotate") == 0)
+    {
+        held = 0;
+        reschedule(quantum_ms > 0 ? sched_policy : POLICY_RR);
+        fprintf(out, "ok\n");
+    }
+    else if (strcmp(cmd, "stats") == 0)
+    {
+        account_running();
+        for (int i = 0; i < child_count; i++)
+        {
+            if (children[i].removed)
+                continue;
+            fprintf(out, "child %d pid %d state %s switches %d run_ms %.1f counter %lld\n", i, children[i].pid,
+                    children[i].slot != -1 ? "active" : "paused", children[i].switches, children[i].run_ns / 1e6,
+                    __atomic_load_n(&counters[i].counter, __ATOMIC_RELAXED));
+        }
+        fprintf(out, "ok %d children, quantum %d ms%s\n", live_count, quantum_ms, held ? ", held" : "");
+    }
+    else
+        fprintf(out, "error unknown command %s\n", cmd);
+}
 
+int open_control(char *path)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return -1;
+    strcpy(addr.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        ERR("socket");
+    // A socket left behind by a previous run is replaced, anything else at path is kept
+    struct stat st;
+    if (lstat(path, &st) == 0)
+    {
+        if (!S_ISSOCK(st.st_mode))
+        {
+            errno = EADDRINUSE;
+            ERR(path);
+        }
+        unlink(path);
+    }
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+        ERR("bind");
+    if (listen(fd, CONTROL_CLIENTS) == -1)
+        ERR("listen");
+    for (int k = 0; k < CONTROL_CLIENTS; k++)
+        control_clients[k].fd = -1;
+    return fd;
+}
+
+void accept_client()
+{
+    int fd = accept4(control_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1)
+    {
+        if (errno == EINTR || errno == ECONNABORTED)
+            return;
+        ERR("accept");
+    }
+    for (int k = 0; k < CONTROL_CLIENTS; k++)
+    {
+        if (control_clients[k].fd == -1)
+        {
+            control_clients[k].fd = fd;
+            control_clients[k].len = 0;
+            return;
+        }
+    }
+    close(fd); // No free entry, the client sees the connection closed
+}
+
+// Runs every complete command line the client has sent and answers the whole batch with one write
+void serve_client(control_client_t *c)
+{
+    ssize_t count = read(c->fd, c->buf + c->len, CONTROL_BUFFER - c->len);
+    if (count < 0 && errno == EINTR)
+        return;
+    if (count <= 0)
+    {
+        close(c->fd);
+        c->fd = -1;
+        return;
+    }
+    c->len += count;
+
+    char *reply = NULL;
+    size_t reply_len = 0;
+    FILE *out = open_memstream(&reply, &reply_len);
+    if (out == NULL)
+        ERR("open_memstream");
+    char *line = c->buf, *end;
+    while ((end = memchr(line, '\n', c->buf + c->len - line)) != NULL)
+    {
+        *end = '\0';
+        run_command(line, out);
+        line = end + 1;
+    }
+    c->len -= line - c->buf;
+    memmove(c->buf, line, c->len);
+    if (c->len == CONTROL_BUFFER)
+    {
+        fprintf(out, "error line too long\n");
+        c->len = 0;
+    }
+    fclose(out);
+
+    for (size_t sent = 0; sent < reply_len;)
+    {
+        ssize_t n = send(c->fd, reply + sent, reply_len - sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+        {
+            close(c->fd); // The client went away, its remaining replies are dropped
+            c->fd = -1;
+            break;
+        }
+        sent += n;
+    }
+    free(reply);
+}
+
+// Rotates children every quantum_ms (or on SIGUSR1 only if quantum_ms is 0) until SIGINT,
+// printing the dashboard every dashboard_ms and on SIGQUIT and serving the control socket
+void scheduler_loop(int dashboard_ms)
+{
+    struct pollfd fds[5 + CONTROL_CLIENTS];
+    int client_of[5 + CONTROL_CLIENTS]; // control client entry behind each pollfd, -1 for the others
+    int dash_fd = -1, tick_fd = -1;
+    // The quantum timer always exists so the control socket can start it later
+    sched_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC | TFD_NONBLOCK);
+    if (sched_fd == -1)
+        ERR("timerfd_create");
+    set_quantum(quantum_ms);
+    if (dashboard_ms > 0)
+    {
+        dash_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (dash_fd == -1)
+            ERR("timerfd_create");
+        struct itimerspec its;
+        its.it_value.tv_sec = dashboard_ms / 1000;
+        its.it_value.tv_nsec = (dashboard_ms % 1000) * 1000000L;
+        its.it_interval = its.it_value;
+        if (timerfd_settime(dash_fd, 0, &its, NULL) == -1)
+            ERR("timerfd_settime");
+    }
+    if (backend == BACKEND_COROUTINE)
+    {
+        // Drives the timer wheel of the coroutines, one tick per millisecond
+        tick_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (tick_fd == -1)
+            ERR("timerfd_create");
+        struct itimerspec its = { { 0, 1000000L }, { 0, 1000000L } };
+        if (timerfd_settime(tick_fd, 0, &its, NULL) == -1)
+            ERR("timerfd_settime");
+    }
+
+    if (quantum_ms > 0)
+        reschedule(sched_policy);
+    while (keep_working)
+    {
+        int rotate = 0, dump = 0;
+        int nfds = 0;
+        // The pool's epoll instance turns readable when a child exits
+        int listeners[5] = { sched_fd, dash_fd, tick_fd, control_fd, backend == BACKEND_PROCESS ? pool.epfd : -1 };
+        for (int k = 0; k < 5; k++)
+        {
+            if (listeners[k] == -1)
+                continue;
+            fds[nfds].fd = listeners[k];
+            client_of[nfds++] = -1;
+        }
+        for (int k = 0; k < CONTROL_CLIENTS; k++)
+        {
+            if (control_clients[k].fd == -1)
+                continue;
+            fds[nfds].fd = control_clients[k].fd;
+            client_of[nfds++] = k;
+        }
+        for (int k = 0; k < nfds; k++)
+            fds[k].events = POLLIN;
+
+        if (poll(fds, nfds, expire_removals()) < 0)
+        {
+            if (errno != EINTR)
+                ERR("poll");
+        }
+        else
+        {
+            for (int k = 0; k < nfds && keep_working; k++)
+            {
+                unsigned long long expirations;
+                if (!(fds[k].revents & (POLLIN | POLLHUP | POLLERR)))
+                    continue;
+                if (client_of[k] != -1)
+                    serve_client(&control_clients[client_of[k]]);
+                else if (fds[k].fd == control_fd)
+                    accept_client();
+                else if (fds[k].fd == pool.epfd)
+                {
+                    if (pool_reap(&pool, 0, NULL) == -1 && errno != EINTR)
+                        ERR("pool_reap");
+                }
+                else
+                {
+                    // A quantum timer rearmed by a command earlier in this round has nothing to read
+                    if (read(fds[k].fd, &expirations, sizeof(expirations)) < 0 && errno != EINTR &&
+                        errno != EAGAIN)
+                        ERR("read");
+                    if (fds[k].fd == sched_fd)
+                        rotate = 1;
+                    else if (fds[k].fd == dash_fd)
+                        dump = 1;
+                }
+            }
+        }
+        if (rotate_requested)
+        {
+            rotate_requested = 0;
+            rotate = 1;
+        }
+        if (dump_requested)
+        {
+            dump_requested = 0;
+            dump = 1;
+        }
+        if (!keep_working)
+            break;
+        if (rotate && !held)
+            reschedule(quantum_ms > 0 ? sched_policy : POLICY_RR);
+        if (dump)
+            print_dashboard();
+        if (backend == BACKEND_COROUTINE)
+        {
+            co_advance_wheel();
+            co_run_ready();
+        }
+    }
+    close(sched_fd);
+    if (dash_fd != -1)
+        close(dash_fd);
+    if (tick_fd != -1)
+        close(tick_fd);
+}
+
+void usage(char *name)
+{
+    fprintf(stderr, "USAGE: %s [-q quantum_ms] [-p rr|wfq|prio] [-w w1,w2,...] [-m coop|stop]\n"
+                    "\t[-g | -M active] [-a] [-d dashboard_ms] [-s] [-t grace_ms] [-c socket_path] [-u]\n"
+                    "\t[-j json_path] [-L level[:every]] [-e trace_path]\n"
+                    "\t<number_of_children>\n", name);
+    fprintf(stderr, "\tquantum_ms - rotate children on a timer instead of on SIGUSR1\n");
+    fprintf(stderr, "\twfq - share time in proportion to weights, prio - run the highest weight\n");
+    fprintf(stderr, "\tstop - enforce pauses with SIGSTOP/SIGCONT, coop - children pause themselves\n");
+    fprintf(stderr, "\tactive - children running at once (default 1), -g - one per CPU it may run on\n");
+    fprintf(stderr, "\t-a - pin the child of each slot to its own CPU\n");
+    fprintf(stderr, "\tdashboard_ms - print the counters dashboard periodically, SIGQUIT prints it on demand\n");
+    fprintf(stderr, "\t-s - do not print every iteration of the children\n");
+    fprintf(stderr, "\tgrace_ms - time children get to stop on SIGTERM before SIGKILL (default 1000)\n");
+    fprintf(stderr, "\tsocket_path - UNIX socket taking one command per line: switch i, pause, resume i j ...,\n"
+                    "\t\tquantum ms, rotate, add n, remove i, stats\n");
+    fprintf(stderr, "\t-u - run the children as coroutines in the parent instead of processes\n");
+    fprintf(stderr, "\tjson_path - also write the resource usage of the child processes there as JSON\n");
+    fprintf(stderr, "\tlevel - 0 logs nothing, 1 only starts, pauses and exits, 2 also every iteration (default);\n"
+                    "\t\tevery - log one in every that many iterations of each child (default 1)\n");
+    fprintf(stderr, "\ttrace_path - write a Chrome trace of the forks, signals, pauses, sleeps and reaps there\n");
+    exit(EXIT_FAILURE);
+}
 
 int main(int argc, char **argv)
 {
     printf("Parent PID: %d\n", getpid());
-    if (argc != 2)
+    int dashboard_ms = 0;
+    char *control_path = NULL;
+    char *json_path = NULL;
+    char *trace_file = NULL;
+    char *weights = NULL;
+    int c;
+    while ((c = getopt(argc, argv, "q:p:w:m:gM:ad:st:c:uj:L:e:")) != -1)
+    {
+        switch (c)
+        {
+            case 'q':
+                quantum_ms = atoi(optarg);
+                if (quantum_ms <= 0)
+                    usage(argv[0]);
+                break;
+            case 'p':
+                if (strcmp(optarg, "rr") == 0)
+                    sched_policy = POLICY_RR;
+                else if (strcmp(optarg, "wfq") == 0)
+                    sched_policy = POLICY_WFQ;
+                else if (strcmp(optarg, "prio") == 0)
+                    sched_policy = POLICY_PRIO;
+                else
+                    usage(argv[0]);
+                break;
+            case 'w':
+                weights = optarg;
+                break;
+            case 'm':
+                if (strcmp(optarg, "coop") == 0)
+                    pause_mode = PAUSE_COOP;
+                else if (strcmp(optarg, "stop") == 0)
+                    pause_mode = PAUSE_STOP;
+                else
+                    usage(argv[0]);
+                break;
+            case 'g':
+                active_count = 0; // Resolved to the allowed CPU count below
+                break;
+            case 'M':
+                active_count = atoi(optarg);
+                if (active_count <= 0)
+                    usage(argv[0]);
+                break;
+            case 'a':
+                pin_slots = 1;
+                break;
+            case 'd':
+                dashboard_ms = atoi(optarg);
+                if (dashboard_ms <= 0)
+                    usage(argv[0]);
+                break;
+            case 's':
+                print_iterations = 0;
+                break;
+            case 't':
+                grace_ms = atoi(optarg);
+                if (grace_ms < 0)
+                    usage(argv[0]);
+                break;
+            case 'c':
+                control_path = optarg;
+                break;
+            case 'u':
+                backend = BACKEND_COROUTINE;
+                break;
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'e':
+                trace_file = optarg;
+                break;
+            case 'L':
+                if (rlog_parse(optarg) == -1)
+                    usage(argv[0]);
+                break;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (argc - optind != 1)
         usage(argv[0]);
 
-    child_count = atoi(argv[1]);
+    child_count = atoi(argv[optind]);
     if (child_count <= 0)
         usage(argv[0]);
 
-    // Allocate memory for child PIDs
-    child_pids = malloc(child_count * sizeof(pid_t));
-    if (child_pids == NULL)
-        ERR("malloc");
+    if (sched_getaffinity(0, sizeof(cpu_mask), &cpu_mask) == -1 || CPU_COUNT(&cpu_mask) == 0)
+    {
+        CPU_ZERO(&cpu_mask);
+        CPU_SET(0, &cpu_mask);
+    }
+    cpu_count = CPU_COUNT(&cpu_mask);
+    if (active_count == 0)
+        active_count = cpu_count;
+    if (active_count > child_count)
+        active_count = child_count;
 
-    // Set the parent signal handler for SIGUSR1
+    // Allocate memory for child and slot bookkeeping
+    children = calloc(child_count, sizeof(child_info_t));
+    slot_child = malloc(active_count * sizeof(int));
+    if (children == NULL || slot_child == NULL)
+        ERR("calloc");
+    for (int s = 0; s < active_count; s++)
+        slot_child[s] = -1;
+    for (int i = 0; i < child_count; i++)
+    {
+        children[i].slot = -1;
+        children[i].weight = 1;
+        if (weights != NULL && *weights != '\0')
+        {
+            children[i].weight = strtol(weights, &weights, 10);
+            if (*weights == ',')
+                weights++;
+        }
+        if (children[i].weight <= 0 && sched_policy == POLICY_WFQ)
+            usage(argv[0]);
+    }
+
+    // Counters are shared with the children, one cache line each; children forked later
+    // inherit the same mapping, so room for the ones added over the control socket is reserved now
+    counter_capacity = control_path != NULL ? child_count + SPARE_CHILDREN : child_count;
+    counters = mmap(NULL, counter_capacity * sizeof(counter_slot_t), PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (counters == MAP_FAILED)
+        ERR("mmap");
+    if (trace_file != NULL && trace_init(trace_file) == -1)
+        ERR("trace_init");
+    // The collector is forked before any child, so none of them inherits it; coroutines log from the parent
+    if (rlog_init(backend == BACKEND_PROCESS ? counter_capacity + 1 : 1) == -1)
+        ERR("rlog_init");
+
+    // Set the parent signal handlers; pause acknowledgements are collected with sigtimedwait
     sethandler(sigusr1_handler, SIGUSR1);
     sethandler(sigint_handler, SIGINT);
+    sethandler(sigquit_handler, SIGQUIT);
+    sigset_t ack_mask;
+    sigemptyset(&ack_mask);
+    sigaddset(&ack_mask, SIGUSR2);
+    sigprocmask(SIG_BLOCK, &ack_mask, NULL);
+    if (control_path != NULL && (control_fd = open_control(control_path)) == -1)
+        usage(argv[0]);
+    if (backend == BACKEND_COROUTINE)
+    {
+        // Allocated for the whole capacity, the lists point into this array
+        coroutines = calloc(counter_capacity, sizeof(coroutine_t));
+        if (coroutines == NULL)
+            ERR("calloc");
+        co_stack = mmap(NULL, CO_STACK_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (co_stack == MAP_FAILED)
+            ERR("mmap");
+        co_list_init(&ready);
+        for (int k = 0; k < WHEEL_SLOTS; k++)
+            co_list_init(&wheel[k]);
+    }
+    if (backend == BACKEND_PROCESS)
+    {
+        if (pool_init(&pool, child_count) == -1)
+            ERR("pool_init");
+        pool.on_exit = child_reaped;
+    }
     // Create child processes
-    create_children(child_count);
+    create_children(0, child_count);
+    sched_start = now_ns();
 
-    while (keep_working!=0)
-    {
-        pause();
+    last_dashboard = sched_start;
 
+    scheduler_loop(dashboard_ms);
+    if (control_fd != -1)
+    {
+        close_control();
+        unlink(control_path);
     }
 
-    printf("why are we not here\n");
-    cleanup_children();
+    printf("Parent received SIGINT.\n");
+    print_sched_report();
+    if (backend == BACKEND_PROCESS)
+        shutdown_children(grace_ms);
+    if (rlog_close() == -1)
+        ERR("rlog_close");
+    if (backend == BACKEND_PROCESS)
+    {
+        pool_print_usage(stdout, pool.children, pool.count, REPORT_ROWS);
+        if (json_path != NULL && pool_write_usage_json(json_path, pool.children, pool.count) == -1)
+            ERR("pool_write_usage_json");
+        pool_free(&pool);
+    }
+    munmap(counters, counter_capacity * sizeof(counter_slot_t));
 
-    free(child_pids);
+    if (backend == BACKEND_COROUTINE)
+    {
+        for (int i = 0; i < child_count; i++)
+        {
+            free(coroutines[i].ctx);
+            free(coroutines[i].saved);
+        }
+        munmap(co_stack, CO_STACK_SIZE);
+    }
+    free(coroutines);
+    free(candidates);
+    free(select_order);
+    free(run_buffer);
+    free(slot_child);
+    free(children);
+    if (trace_close() == -1)
+        ERR("trace_close");
     printf("Parent quits.\n");
     return EXIT_SUCCESS;
 }
@@ -4,31 +4,73 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../common/perf.h"
+#include "../common/pool.h"
+#include "../common/stream.h"
+#include "../common/supervisor.h"
+#include "../common/throttle.h"
+#include "../common/utf8.h"
+
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), kill(0, SIGKILL), exit(EXIT_FAILURE))
+// Error in a worker: supervised (-r), only the worker fails and the parent retries its chunk
+#define WERR(source) \
+    (max_retries >= 0 ? (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE)) : ERR(source))
 
 volatile sig_atomic_t last_sig = 0;
-pid_t *child_pids;
+pool_t pool;
+perf_sample_t* perf_samples = NULL; // shared with the children, one entry each, if counting
+int max_retries = -1; // retries of a failed chunk, -1 if not supervised
+throttle_t* throttle = NULL; // output rate of all the children together, if limited
+int file_fd;
+const char* file_path;
+off_t file_size;
+int workers;
+off_t* part_start = NULL; // where the part of each child starts, and the file size after the last
+int utf8 = 0; // whether parts only split the file between UTF-8 code points
 
 ssize_t bulk_read(int fd, char* buf, size_t count)
 {
     ssize_t c;
     ssize_t len = 0;
+    long long start = trace_now();
     do
     {
         c = TEMP_FAILURE_RETRY(read(fd, buf, count));
         if (c < 0)
             return c;
         if (c == 0)
-            return len;  // EOF
+            break;  // EOF
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    trace_span("read", start, "fd", fd, "bytes", len);
+    return len;
+}
+
+ssize_t bulk_pread(int fd, char* buf, size_t count, off_t offset)
+{
+    ssize_t c;
+    ssize_t len = 0;
+    long long start = trace_now();
+    do
+    {
+        c = TEMP_FAILURE_RETRY(pread(fd, buf, count, offset + len));
+        if (c < 0)
+            return c;
+        if (c == 0)
+            break;  // EOF
         buf += c;
         len += c;
         count -= c;
     } while (count > 0);
+    trace_span("read", start, "fd", fd, "bytes", len);
     return len;
 }
 
@@ -36,6 +78,7 @@ ssize_t bulk_write(int fd, char* buf, size_t count)
 {
     ssize_t c;
     ssize_t len = 0;
+    long long start = trace_now();
     do
     {
         c = TEMP_FAILURE_RETRY(write(fd, buf, count));
@@ -45,13 +88,21 @@ ssize_t bulk_write(int fd, char* buf, size_t count)
         len += c;
         count -= c;
     } while (count > 0);
+    trace_span("write", start, "fd", fd, "bytes", len);
     return len;
 }
 
 void usage(int argc, char* argv[])
 {
-    printf("%s p k \n", argv[0]);
-    printf("\tp - path to file to be encrypted\n");
+    printf("%s [-j json_path] [-e trace_path] [-p] [-r retries] [-b rate[:burst]] [-u] p k \n", argv[0]);
+    printf("\tjson_path - also write the resource usage of the children there as JSON\n");
+    printf("\t-p - count cycles, instructions and cache misses of every child's transform and write phase\n");
+    printf("\ttrace_path - write a Chrome trace of the forks, signals, sleeps, reads and writes there\n");
+    printf("\tretries - supervise the children: a failed one is replaced for its part only, at most retries times\n");
+    printf("\trate - write at most rate bytes per second in all, burst bytes at once after a pause,\n");
+    printf("\t\tinstead of every child writing a byte each 100 ms\n");
+    printf("\t-u - the text is UTF-8, parts are not split inside a character\n");
+    printf("\tp - path to file to be encrypted, - to encrypt stdin onto stdout (without -p, -r and -b)\n");
     printf("\t0 < k < 8 - number of child processes\n");
     exit(EXIT_FAILURE);
 }
@@ -67,16 +118,35 @@ void sethandler(void (*f)(int), int sigNo)
 
 void sigusr1_handler(int sig)
 {
+    trace_signal(sig, 0);
     last_sig = sig;
 }
 void sigint_handler(int sig)
 {
+    trace_signal(sig, 0);
     last_sig = sig;
 }
 
+// Shifts the lower case ASCII letters, 16 at a time where SSE2 is available; UTF-8 sequences
+// other than ASCII never contain those bytes, so they are left intact
 void caesar_cipher(char *text, size_t size, int shift)
 {
-    for (size_t i = 0; i < size; i++)
+    shift %= 26;
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i before_a = _mm_set1_epi8('a' - 1), after_z = _mm_set1_epi8('z' + 1);
+    const __m128i last = _mm_set1_epi8('z' - shift), by = _mm_set1_epi8(shift), wrap = _mm_set1_epi8(26);
+    for (; i + 16 <= size; i += 16)
+    {
+        __m128i c = _mm_loadu_si128((const __m128i *)(text + i));
+        __m128i lower = _mm_and_si128(_mm_cmpgt_epi8(c, before_a), _mm_cmplt_epi8(c, after_z));
+        // Bytes from 0x80 up compare as negative, so they are never lower case letters
+        __m128i shifted = _mm_sub_epi8(_mm_add_epi8(c, by), _mm_and_si128(_mm_cmpgt_epi8(c, last), wrap));
+        c = _mm_or_si128(_mm_and_si128(lower, shifted), _mm_andnot_si128(lower, c));
+        _mm_storeu_si128((__m128i *)(text + i), c);
+    }
+#endif
+    for (; i < size; i++)
     {
         char c = text[i];
         if (c >= 'a' && c <= 'z')
@@ -86,41 +156,38 @@ void caesar_cipher(char *text, size_t size, int shift)
     }
 }
 
+void caesar_block(char *block, size_t size)
+{
+    caesar_cipher(block, size, 3);
+}
+
 void child_work(int fd, off_t offset, size_t size, int child_no, const char* path)
 {
     sigset_t mask, oldmask;
     sigemptyset(&mask);
     sigaddset(&mask, SIGUSR1);
     sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    sigdelset(&oldmask, SIGUSR1); // Children are created with it blocked, so it is never lost
 
     printf("PID: %d, Offset: %ld, Size: %zu\n", getpid(), offset, size);
     char* buf = malloc(size);
     if (!buf)
-        ERR("malloc");
-
-    off_t result;
-    do 
-    {
-        result = lseek(fd, offset, SEEK_SET);
-    } 
-    while (result == -1 && errno == EINTR);
-    
-    if (result == -1)
-        ERR("lseek");
+        WERR("malloc");
 
+    // The children share the file offset of fd, so each reads at its own offset instead of seeking
     ssize_t bytes_read;
     do 
     {
-        bytes_read = bulk_read(fd, buf, size);
+        bytes_read = bulk_pread(fd, buf, size, offset);
     } 
     while (bytes_read == -1 && errno == EINTR);
     
     if (bytes_read < 0)
-        ERR("read");
+        WERR("read");
 
     while (last_sig != SIGUSR1)
     {
-        sigsuspend(&oldmask);
+        trace_sigsuspend(&oldmask);
     }
 
     //caesar_cipher(buf, size, 3);
@@ -129,35 +196,55 @@ void child_work(int fd, off_t offset, size_t size, int child_no, const char* pat
     snprintf(output_filename, sizeof(output_filename), "%s-%d", path, child_no);
     int out_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
     if (out_fd == -1)
-        ERR("open output file");
+        WERR("open output file");
 
     struct timespec ts;
     ts.tv_sec = 0;
     ts.tv_nsec = 100000000;    
     sigemptyset(&mask);
     sigaddset(&mask, SIGINT);
-    for (size_t i = 0; i < size; i++)
+    perf_group_t perf;
+    if (perf_samples != NULL)
     {
-        if (buf[i] >= 'a' && buf[i] <= 'z')
+        perf_open(&perf);
+        perf_start(&perf);
+    }
+    // Throttled, the bytes go in batches as the shared bucket allows, otherwise one every 100 ms
+    size_t batch = throttle != NULL ? throttle_batch(throttle) : 1;
+    for (size_t i = 0; i < size; i += batch)
+    {
+        size_t n = size - i < batch ? size - i : batch;
+        caesar_cipher(&buf[i], n, 3);
+        if (throttle != NULL)
         {
-            buf[i] = (buf[i] - 'a' + 3) % 26 + 'a';
+            sigprocmask(SIG_BLOCK, &mask, &oldmask);
+            throttle_take(throttle, n);
+            sigprocmask(SIG_UNBLOCK, &mask, NULL);
         }
         ssize_t bytes_written;
         do 
         {
-            bytes_written = bulk_write(out_fd, &buf[i], 1);
+            bytes_written = bulk_write(out_fd, &buf[i], n);
         } 
         while (bytes_written == -1 && errno == EINTR);
         
         if (bytes_written < 0)
-            ERR("write");
+            WERR("write");
 
+        if (throttle != NULL)
+            continue;
         sigprocmask(SIG_BLOCK, &mask, &oldmask);
         //usleep(100000);
-        nanosleep(&ts, NULL); 
+        trace_nanosleep(&ts, NULL); 
         sigprocmask(SIG_UNBLOCK, &mask, NULL);
     }
 
+    if (perf_samples != NULL)
+    {
+        perf_stop(&perf, &perf_samples[child_no]);
+        perf_samples[child_no].bytes = size;
+        perf_close(&perf);
+    }
     close(out_fd);
     free(buf);
     printf("PID: %d quits\n", getpid());
@@ -165,74 +252,205 @@ void child_work(int fd, off_t offset, size_t size, int child_no, const char* pat
 
 
 
+// Forks child i for its part of the file; in the parent it is added to the pool
+pid_t create_child(int i)
+{
+    off_t offset = part_start[i];
+    size_t size = part_start[i + 1] - offset;
+    fflush(stdout); // The child must not inherit output the parent has not written yet
+    pid_t pid = pool_fork(&pool);
+    if (pid == 0)
+    {
+        trace_name("child", i);
+        sethandler(sigusr1_handler, SIGUSR1);
+        sethandler(sigint_handler, SIGINT);
+        child_work(file_fd, offset, size, i, file_path);
+        close(file_fd);
+        exit(EXIT_SUCCESS); // Exit child process
+    }
+    return pid;
+}
+
+// Replaces a failed child, which can start right away
+pid_t retry_child(int i)
+{
+    pid_t pid = create_child(i);
+    if (pid > 0)
+        trace_kill(pid, SIGUSR1);
+    return pid;
+}
+
 void create_children(int fd, int n, const char* path)
 {
     struct stat st;
     if (fstat(fd, &st) == -1)
         ERR("fstat");
 
-    off_t file_size = st.st_size;
+    file_fd = fd;
+    file_path = path;
+    file_size = st.st_size;
+    workers = n;
+    part_start = malloc((n + 1) * sizeof(off_t));
+    if (part_start == NULL)
+        ERR("malloc");
     size_t part_size = file_size / n;
-    size_t last_part_size = part_size + (file_size % n);
-
     for (int i = 0; i < n; i++)
     {
-        pid_t pid = fork();
-        if (pid < 0)
-            ERR("fork");
-        if (pid == 0)
+        part_start[i] = i * part_size;
+        if (utf8 && i > 0)
         {
-            sethandler(sigusr1_handler, SIGUSR1);
-            sethandler(sigint_handler, SIGINT);
-            size_t size = (i == n - 1) ? last_part_size : part_size;
-            off_t offset = i * part_size;
-            child_work(fd, offset, size, i, path);
-            close(fd);
-            exit(EXIT_SUCCESS); // Exit child process
+            part_start[i] = utf8_snap_fd(fd, part_start[i]);
+            if (part_start[i] < part_start[i - 1])
+                part_start[i] = part_start[i - 1];
         }
-        child_pids[i] = pid;
-    }
-}
-
-int main(int argc, char* argv[])
-{
-    if (argc != 3)
-    {
-        usage(argc, argv);
     }
-
-    char* path = argv[1];
-    int k = atoi(argv[2]);
-
-    if (k <= 0 || k >= 8)
+    part_start[n] = file_size; // The last part also gets the remainder
+    for (int i = 0; i < n; i++)
     {
-        usage(argc, argv);
+        if (create_child(i) < 0)
+            ERR("fork");
     }
+}
 
-    child_pids = malloc(k * sizeof(pid_t));
-
+// Encrypts the file in k parts, one child each; returns how many parts failed
+int encrypt_file(const char* path, int k)
+{
     int fd = open(path, O_RDONLY);
     if (fd == -1)
         ERR("open");
 
+    // Blocked until the children wait for it, so a retried child may get it right away
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
     printf("Parent PID: %d\n", getpid());
     create_children(fd, k, path);
 
+    long long start = trace_now();
     sleep(1);
+    trace_span("sleep", start, "requested_us", 1000000, NULL, 0);
 
     for(int i = 0; i < k; i++)
     {
-        kill(child_pids[i], SIGUSR1);
+        trace_kill(pool.children[i].pid, SIGUSR1);
     }
 
-    while (wait(NULL) > 0)
+    int failed = 0;
+    if (max_retries >= 0)
     {
-        ;
+        supervisor_t sup;
+        if (supervisor_init(&sup, &pool, k, max_retries, retry_child) == -1)
+            ERR("supervisor_init");
+        failed = supervise(&sup);
+        if (failed == -1)
+            ERR("supervise");
+        supervisor_free(&sup);
     }
-
-    free(child_pids);
+    else if (pool_wait_all(&pool) == -1)
+        ERR("pool_wait_all");
+    free(part_start);
     close(fd);
-    printf("Parent quits\n");
+    return failed;
+}
+
+int main(int argc, char* argv[])
+{
+    char* json_path = NULL;
+    char* trace_file = NULL;
+    int c;
+    long long rate = 0, burst = 0;
+    while ((c = getopt(argc, argv, "j:e:pr:b:u")) != -1)
+    {
+        switch (c)
+        {
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'e':
+                trace_file = optarg;
+                break;
+            case 'p':
+                perf_samples = MAP_FAILED; // Mapped once k is known
+                break;
+            case 'r':
+                max_retries = atoi(optarg);
+                if (max_retries < 0)
+                    usage(argc, argv);
+                break;
+            case 'b':
+                if (throttle_parse(optarg, &rate, &burst) == -1)
+                    usage(argc, argv);
+                break;
+            case 'u':
+                utf8 = 1;
+                break;
+            default:
+                usage(argc, argv);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(argc, argv);
+    }
+
+    char* path = argv[optind];
+    int k = atoi(argv[optind + 1]);
+
+    if (k <= 0 || k >= 8 || (strcmp(path, "-") == 0 && (perf_samples != NULL || max_retries >= 0 || rate > 0)))
+    {
+        usage(argc, argv);
+    }
+
+    if (perf_samples != NULL)
+    {
+        perf_samples = mmap(NULL, k * sizeof(perf_sample_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (perf_samples == MAP_FAILED)
+            ERR("mmap");
+        for (int i = 0; i < k; i++)
+        {
+            for (int j = 0; j < PERF_COUNTERS; j++)
+                perf_samples[i].value[j] = -1; // Stays so for a child that never reports
+        }
+    }
+    if (trace_file != NULL && trace_init(trace_file) == -1)
+        ERR("trace_init");
+    if (rate > 0 && (throttle = throttle_init(rate, burst)) == NULL)
+        ERR("throttle_init");
+    if (pool_init(&pool, k) == -1)
+        ERR("pool_init");
+
+    FILE* report = stdout;
+    int failed = 0;
+    if (strcmp(path, "-") == 0)
+    {
+        report = stderr; // stdout carries the data
+        if (stream_run(&pool, STDIN_FILENO, STDOUT_FILENO, k, caesar_block, utf8 ? utf8_complete : NULL) == -1)
+            ERR("stream_run");
+    }
+    else
+        failed = encrypt_file(path, k);
+    pool_print_usage(report, pool.children, pool.count, pool.count);
+    if (perf_samples != NULL)
+    {
+        perf_print(report, perf_samples, k);
+        munmap(perf_samples, k * sizeof(perf_sample_t));
+    }
+    if (json_path != NULL && pool_write_usage_json(json_path, pool.children, pool.count) == -1)
+        ERR("pool_write_usage_json");
+
+    pool_free(&pool);
+    if (throttle != NULL)
+        throttle_free(throttle);
+    if (trace_close() == -1)
+        ERR("trace_close");
+    if (failed > 0)
+    {
+        fprintf(report, "Parent quits, %d of %d parts failed\n", failed, k);
+        return EXIT_FAILURE;
+    }
+    fprintf(report, "Parent quits\n");
     return EXIT_SUCCESS;
 }
 
@@ -1,34 +1,104 @@
 #define _GNU_SOURCE
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
+#include <linux/sched.h>
+#include <sched.h>
+#include <spawn.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "../common/perf.h"
+#include "../common/pool.h"
+#include "../common/stream.h"
+#include "../common/supervisor.h"
+#include "../common/throttle.h"
+#include "../common/utf8.h"
+
 #define ERR(source) (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), kill(0, SIGKILL), exit(EXIT_FAILURE))
+// Error in a worker: supervised (-r), only the worker fails and the parent retries its part
+#define WERR(source) \
+    (max_retries >= 0 ? (perror(source), fprintf(stderr, "%s:%d\n", __FILE__, __LINE__), exit(EXIT_FAILURE)) : ERR(source))
+
+#define WORKER_ARG "--worker" // argv[1] of a worker started by posix_spawn
+#define WORKER_ARGC 10
+#define MIN_WINDOW 4096 // smallest part of its part a worker holds under a memory budget
+
+// How workers are created
+enum { CREATE_FORK, CREATE_SPAWN, CREATE_CLONE3, CREATE_SERVER };
+const char* create_names[] = { "fork", "spawn", "clone3", "server" };
+
+// Request to the fork server for one worker; the worker maps its part of the file itself
+typedef struct {
+    int index;
+    off_t offset;
+    size_t size;
+} spawn_request_t;
+
+extern char** environ;
 
 volatile sig_atomic_t last_sig = 0;
-pid_t *child_pids;
+pool_t pool;
+perf_sample_t* perf_samples = NULL; // shared with the children, one entry each, if counting
+pid_t server_pid = -1;
+int server_sock = -1;
+int max_retries = -1; // retries of a failed part, -1 if not supervised
+throttle_t* throttle = NULL; // output rate of all the workers together, if limited
+int create_method = CREATE_FORK;
+int file_fd;
+const char* file_path;
+off_t file_size;
+char* file_content = NULL; // read by the parent for workers created from it
+int workers;
+off_t* part_start = NULL; // where the part of each worker starts, and the file size after the last
+int utf8 = 0; // whether the text is UTF-8: parts split it between code points, letters are not only ASCII
+size_t window = 0; // with a memory budget, bytes of its part a worker reads and holds at once; 0: all of it
 
 ssize_t bulk_read(int fd, char* buf, size_t count)
 {
     ssize_t c;
     ssize_t len = 0;
+    long long start = trace_now();
     do
     {
         c = TEMP_FAILURE_RETRY(read(fd, buf, count));
         if (c < 0)
             return c;
         if (c == 0)
-            return len;  // EOF
+            break;  // EOF
         buf += c;
         len += c;
         count -= c;
     } while (count > 0);
+    trace_span("read", start, "fd", fd, "bytes", len);
+    return len;
+}
+
+ssize_t bulk_pread(int fd, char* buf, size_t count, off_t offset)
+{
+    ssize_t c;
+    ssize_t len = 0;
+    long long start = trace_now();
+    do
+    {
+        c = TEMP_FAILURE_RETRY(pread(fd, buf, count, offset + len));
+        if (c < 0)
+            return c;
+        if (c == 0)
+            break;  // EOF
+        buf += c;
+        len += c;
+        count -= c;
+    } while (count > 0);
+    trace_span("read", start, "fd", fd, "bytes", len);
     return len;
 }
 
@@ -36,6 +106,7 @@ ssize_t bulk_write(int fd, char* buf, size_t count)
 {
     ssize_t c;
     ssize_t len = 0;
+    long long start = trace_now();
     do
     {
         c = TEMP_FAILURE_RETRY(write(fd, buf, count));
@@ -45,6 +116,7 @@ ssize_t bulk_write(int fd, char* buf, size_t count)
         len += c;
         count -= c;
     } while (count > 0);
+    trace_span("write", start, "fd", fd, "bytes", len);
     return len;
 }
 
@@ -59,170 +131,694 @@ void sethandler(void (*f)(int), int sigNo)
 
 void sigusr1_handler(int sig)
 {
+    trace_signal(sig, 0);
     last_sig = sig;
 }  
 
+long long now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
 void usage(int argc, char* argv[])
 {
-    printf("%s n f \n", argv[0]);
-    printf("\tf - file to be processed\n");
+    printf("%s [-j json_path] [-e trace_path] [-p] [-c fork|spawn|clone3|server] [-r retries] [-b rate[:burst]] [-u] [--mem-budget bytes] n f \n", argv[0]);
+    printf("\tjson_path - also write the resource usage of the children there as JSON\n");
+    printf("\t-p - count cycles, instructions and cache misses of every child's transform and write phase\n");
+    printf("\ttrace_path - write a Chrome trace of the forks, signals, sleeps, reads and writes there\n");
+    printf("\tfork - fork workers after reading the file (default), clone3 - the same through clone3,\n");
+    printf("\t\tspawn - posix_spawn workers that map their part of the file,\n");
+    printf("\t\tserver - a helper forked before the file is read creates workers that map their part;\n");
+    printf("\t\tspawned workers are a new program, so -p and -e do not reach them and -b is refused\n");
+    printf("\tretries - supervise the workers: a failed one is replaced for its part only, at most retries times\n");
+    printf("\trate - write at most rate bytes per second in all, burst bytes at once after a pause,\n");
+    printf("\t\tinstead of every worker writing a byte each 250 ms\n");
+    printf("\t-u - the text is UTF-8: parts are not split inside a character, and the letters of\n");
+    printf("\t\tLatin-1 and Latin Extended-A (Polish ones among them) count and change case too\n");
+    printf("\tbytes - keep all the processes together under that much resident memory (K, M, G suffixes)\n");
+    printf("\t\tby reading each part in windows and, if needed, using fewer workers\n");
+    printf("\tf - file to be processed, - to process stdin onto stdout (without -p, -c, -r, -b and --mem-budget);\n");
+    printf("\t\tthen every block of %d KB is a part of its own\n", STREAM_BLOCK / 1024);
     printf("\t0 < n < 10 - number of child processes\n");
     exit(EXIT_FAILURE);
 }
 
-void child_work(const char* content, size_t size, int child_no, const char* path)
+// Swaps the case of every second letter of a part; to_change counts its letters so far
+char alternate_case(char c, int* to_change)
 {
-    sigset_t mask, oldmask;
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGUSR1);
-    sigprocmask(SIG_BLOCK, &mask, &oldmask);
-    
-    while(last_sig!=SIGUSR1)
+    if(c >= 'a' && c <= 'z' || c >= 'A' && c <= 'Z')
     {
-        sigsuspend(&oldmask);
-    }    
-    
-    printf("{%d}: %s\n", getpid(), content);
+        if(*to_change%2==0)
+        {
+            if (c >= 'a' && c <= 'z')
+            {
+                c = (char)(c + 'A' - 'a');
+            }
+            else if (c >= 'A' && c <= 'Z')
+            {
+                c = (char)(c - ('A' - 'a'));
+            }
+        }
 
-    char* buf = (char*)malloc(size);
-    if (buf == NULL)
-        ERR("malloc");
+        (*to_change)++;
+    }
+    return c;
+}
 
-    strcpy(buf, content);
-    
-    char output_filename[256];
-    snprintf(output_filename, sizeof(output_filename), "%s-%d", path, child_no+1);
-    int out_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (out_fd == -1)
-        ERR("open output file");
+// The same for the next size bytes of a part, which with -u must not end inside a character
+void alternate_part(char* buf, size_t size, int* to_change)
+{
+    size_t i = 0;
+    while (i < size)
+    {
+        size_t ascii = utf8 ? utf8_ascii_run(buf + i, size - i) : size - i;
+        for (size_t end = i + ascii; i < end; i++)
+            buf[i] = alternate_case(buf[i], to_change);
+        if (i == size)
+            break;
+        unsigned int cp;
+        size_t len = utf8_decode2(buf + i, size - i, &cp);
+        if (cp != 0 && utf8_is_letter(cp))
+        {
+            if (*to_change % 2 == 0)
+                utf8_encode2(buf + i, utf8_swap_case(cp));
+            (*to_change)++;
+        }
+        i += len;
+    }
+}
 
+void alternate_block(char* block, size_t size)
+{
     int to_change = 0;
+    alternate_part(block, size, &to_change);
+}
 
+// Writes a window of a part, transforming it on the way; to_change carries over between windows
+void write_window(int out_fd, char* buf, size_t size, int* to_change)
+{
     struct timespec ts;
     ts.tv_sec = 0;
     ts.tv_nsec = 250000000;
 
-    for (size_t i = 0; i < size; i++)
+    // Throttled, the bytes go in batches as the shared bucket allows, otherwise one every 250 ms
+    size_t batch = throttle != NULL ? throttle_batch(throttle) : 1;
+    size_t n;
+    for (size_t i = 0; i < size; i += n)
     {
-        if(buf[i] >= 'a' && buf[i] <= 'z' || buf[i] >= 'A' && buf[i] <= 'Z')
-        {
-            if(to_change%2==0)
-            {
-                if (buf[i] >= 'a' && buf[i] <= 'z')
-                {
-                    buf[i] = (char)(buf[i] + 'A' - 'a');
-                }
-                else if (buf[i] >= 'A' && buf[i] <= 'Z')
-                {
-                    buf[i] = (char)(buf[i] - ('A' - 'a'));
-                }
-            }
+        n = size - i < batch ? size - i : batch;
+        while (utf8 && i + n < size && UTF8_CONTINUATION(buf[i + n]))
+            n++; // A character goes at once
+        alternate_part(&buf[i], n, to_change);
+        if (throttle != NULL)
+            throttle_take(throttle, n);
 
-            to_change++;
-        }
-        
         ssize_t bytes_written;
         do 
         {
-            bytes_written = bulk_write(out_fd, &buf[i], 1);
+            bytes_written = bulk_write(out_fd, &buf[i], n);
         } 
         while (bytes_written == -1 && errno == EINTR);
         
         if (bytes_written < 0)
-            ERR("write");
+            WERR("write");
 
         //usleep(250000);
 
-        nanosleep(&ts, NULL);
+        if (throttle == NULL)
+            trace_nanosleep(&ts, NULL);
+    }
+}
+
+// Processes the part at offset, from content if it is in memory, read from fd otherwise
+void child_work(int fd, const char* content, off_t offset, size_t size, int child_no, const char* path)
+{
+    sigset_t mask, oldmask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, &oldmask);
+    sigdelset(&oldmask, SIGUSR1); // Workers are created with it blocked, so it is never lost
+    
+    while(last_sig!=SIGUSR1)
+    {
+        trace_sigsuspend(&oldmask);
+    }    
+    
+    // Under a memory budget only a window of the part is held at once
+    size_t held = window != 0 && window < size ? window : size;
+    char* buf = (char*)malloc(held);
+    if (buf == NULL)
+        WERR("malloc");
+
+    char output_filename[256];
+    snprintf(output_filename, sizeof(output_filename), "%s-%d", path, child_no+1);
+    int out_fd = open(output_filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (out_fd == -1)
+        WERR("open output file");
+
+    int to_change = 0;
+
+    perf_group_t perf;
+    if (perf_samples != NULL)
+    {
+        perf_open(&perf);
+        perf_start(&perf);
+    }
+    size_t len;
+    for (size_t done = 0; done < size; done += len)
+    {
+        len = size - done < held ? size - done : held;
+        if (content != NULL)
+            memcpy(buf, content + done, len); // The part is not NUL-terminated
+        else if (bulk_pread(fd, buf, len, offset + done) != (ssize_t)len)
+            WERR("pread");
+        if (utf8 && done + len < size)
+            len = utf8_complete(buf, len); // The rest of a character starts the next window
+
+        printf("{%d}: %.*s\n", getpid(), (int)len, buf);
+        write_window(out_fd, buf, len, &to_change);
     }
     
+    if (perf_samples != NULL)
+    {
+        perf_stop(&perf, &perf_samples[child_no]);
+        perf_samples[child_no].bytes = size;
+        perf_close(&perf);
+    }
     free(buf);
     close(out_fd);
     //free(content);
 }
 
+// Runs worker i on the part of the file it gets from file_content, which it shares with the
+// parent until either writes to it, or reads from the file under a memory budget
+void copy_worker(const char* file_content, int i, off_t offset, size_t size, const char* path)
+{
+    trace_name("child", i);
+    sethandler(sigusr1_handler, SIGUSR1);
+    child_work(file_fd, file_content != NULL ? file_content + offset : NULL, offset, size, i, path);
+}
+
+// Runs worker i on its part of the file, mapped from fd instead of inherited from the parent,
+// or read from fd under a memory budget
+void map_worker(int fd, int i, off_t offset, size_t size, const char* path)
+{
+    sethandler(sigusr1_handler, SIGUSR1);
+    if (window != 0)
+    {
+        child_work(fd, NULL, offset, size, i, path);
+        return;
+    }
+    off_t start = offset & ~(off_t)(sysconf(_SC_PAGESIZE) - 1);
+    size_t length = size + (offset - start);
+    char* map = length > 0 ? mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, start) : "";
+    if (map == MAP_FAILED)
+        WERR("mmap");
+    child_work(fd, map + (offset - start), offset, size, i, path);
+    if (length > 0)
+        munmap(map, length);
+}
+
+// Like fork() through clone3 with flags, which may add CLONE_PIDFD (the pidfd goes to *pidfd)
+// or CLONE_PARENT; glibc is bypassed, so the child must not rely on raise() or thread state
+pid_t clone3_process(unsigned long flags, int* pidfd)
+{
+    struct clone_args args;
+    memset(&args, 0, sizeof(args));
+    args.flags = flags;
+    args.pidfd = (uintptr_t)pidfd;
+    args.exit_signal = (flags & CLONE_PARENT) ? 0 : SIGCHLD; // A sibling signals the parent's parent as its parent does
+    return syscall(SYS_clone3, &args, sizeof(args));
+}
+
+// Fork server: creates every worker it is asked for as a sibling (CLONE_PARENT), so the
+// workers are children of the main process while their page tables are copied from this
+// small process instead of from a parent holding the whole file
+void server_work(int sock, int fd, const char* path)
+{
+    spawn_request_t req;
+    ssize_t c;
+    while ((c = TEMP_FAILURE_RETRY(recv(sock, &req, sizeof(req), 0))) > 0)
+    {
+        pid_t pid = clone3_process(CLONE_PARENT, NULL);
+        if (pid == 0)
+        {
+            close(sock);
+            trace_name("child", req.index);
+            map_worker(fd, req.index, req.offset, req.size, path);
+            exit(EXIT_SUCCESS);
+        }
+        int reply[2] = { pid, errno };
+        if (TEMP_FAILURE_RETRY(send(sock, reply, sizeof(reply), 0)) != sizeof(reply))
+            ERR("send");
+    }
+    if (c < 0)
+        ERR("recv");
+}
+
+// Forks the fork server, before the parent allocates anything large
+void start_server(int fd, const char* path)
+{
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) == -1)
+        ERR("socketpair");
+    fflush(stdout);
+    server_pid = fork();
+    if (server_pid == -1)
+        ERR("fork");
+    if (server_pid == 0)
+    {
+        close(sv[0]);
+        trace_name("fork server", -1);
+        server_work(sv[1], fd, path);
+        exit(EXIT_SUCCESS);
+    }
+    close(sv[1]);
+    server_sock = sv[0];
+}
+
+pid_t server_spawn(int i, off_t offset, size_t size)
+{
+    spawn_request_t req = { .index = i, .offset = offset, .size = size };
+    int reply[2]; // PID, errno of the server if it failed
+    if (TEMP_FAILURE_RETRY(send(server_sock, &req, sizeof(req), 0)) != sizeof(req))
+        ERR("send");
+    if (TEMP_FAILURE_RETRY(recv(server_sock, reply, sizeof(reply), 0)) != sizeof(reply))
+        ERR("recv");
+    errno = reply[1];
+    return reply[0];
+}
+
+void stop_server()
+{
+    close(server_sock); // The server exits once it reads the end of the requests
+    if (TEMP_FAILURE_RETRY(waitpid(server_pid, NULL, 0)) == -1)
+        ERR("waitpid");
+}
+
+// Starts this program again as worker i, which finds its part through the inherited fd
+pid_t spawn_worker(int fd, int i, off_t offset, size_t size, const char* path)
+{
+    char index[16], off[32], len[32], fdstr[16], retries[16], utf8str[16], windowstr[32];
+    snprintf(index, sizeof(index), "%d", i);
+    snprintf(off, sizeof(off), "%lld", (long long)offset);
+    snprintf(len, sizeof(len), "%zu", size);
+    snprintf(fdstr, sizeof(fdstr), "%d", fd);
+    snprintf(retries, sizeof(retries), "%d", max_retries); // Whether its errors are its own
+    snprintf(utf8str, sizeof(utf8str), "%d", utf8);
+    snprintf(windowstr, sizeof(windowstr), "%zu", window);
+    char* argv[] = { "sop-l2", WORKER_ARG, index, off, len, fdstr, (char*)path, retries, utf8str, windowstr, NULL };
+    pid_t pid;
+    errno = posix_spawn(&pid, "/proc/self/exe", NULL, NULL, argv, environ);
+    return errno == 0 ? pid : -1;
+}
+
+// Creates worker i for its part of the file and adds it to the pool
+pid_t create_worker(int i)
+{
+    off_t offset = part_start[i];
+    size_t size = part_start[i + 1] - offset;
+    long long start = now_ns();
+    pid_t pid;
+    int pidfd = -1;
+    fflush(stdout); // Children must not inherit output the parent has not written yet
+    switch (create_method)
+    {
+        case CREATE_FORK:
+            pid = pool_fork(&pool);
+            break;
+        case CREATE_CLONE3:
+            pid = clone3_process(CLONE_PIDFD, &pidfd);
+            break;
+        case CREATE_SPAWN:
+            pid = spawn_worker(file_fd, i, offset, size, file_path);
+            break;
+        default:
+            pid = server_spawn(i, offset, size);
+    }
+    if (pid == 0)
+    {
+        if (create_method == CREATE_CLONE3)
+            pool_forget(&pool); // pool_fork already dropped it in a forked child
+        copy_worker(file_content, i, offset, size, file_path);
+        free(file_content);
+        exit(EXIT_SUCCESS); // Exit child process
+    }
+    if (pid > 0 && create_method != CREATE_FORK)
+    {
+        if (pool_add(&pool, pid, pidfd) == -1)
+            ERR("pool_add");
+        trace_span(create_names[create_method], start, "child", pid, "index", i); // pool_fork traces itself
+    }
+    return pid;
+}
+
+// Replaces a failed worker, which can start right away
+pid_t retry_worker(int i)
+{
+    pid_t pid = create_worker(i);
+    if (pid > 0)
+        trace_kill(pid, SIGUSR1);
+    return pid;
+}
+
 void create_children(int fd, int n, const char* path)
 {
     struct stat st;
     if (fstat(fd, &st) == -1)
         ERR("fstat");
 
-    off_t file_size = st.st_size;
+    file_fd = fd;
+    file_path = path;
+    file_size = st.st_size;
+    workers = n;
+    part_start = malloc((n + 1) * sizeof(off_t));
+    if (part_start == NULL)
+        ERR("malloc");
     size_t part_size = file_size / n;
-    size_t last_part_size = part_size + (file_size % n);
+    for (int i = 0; i < n; i++)
+    {
+        part_start[i] = i * part_size;
+        if (utf8 && i > 0)
+        {
+            part_start[i] = utf8_snap_fd(fd, part_start[i]);
+            if (part_start[i] < part_start[i - 1])
+                part_start[i] = part_start[i - 1];
+        }
+    }
+    part_start[n] = file_size; // The last part also gets the remainder
 
-    char *file_content = (char *)malloc(file_size);
-    if (file_content == NULL)
-        ERR("malloc");
+    // Only workers created from this process read their part from its copy of the file,
+    // which is kept for the workers that replace failed ones; under a memory budget they read the file
+    if ((create_method == CREATE_FORK || create_method == CREATE_CLONE3) && window == 0)
+    {
+        file_content = (char *)malloc(file_size);
+        if (file_content == NULL)
+            ERR("malloc");
 
-    if (pread(fd, file_content, file_size, 0) != file_size)
-        ERR("pread");
+        if (pread(fd, file_content, file_size, 0) != file_size)
+            ERR("pread");
+    }
 
+    long long total_ns = 0, max_ns = 0;
     for (int i = 0; i < n; i++)
     {
-        pid_t pid = fork();
-        if (pid < 0)
-            ERR("fork");
-        if (pid == 0)
-        {
-            sethandler(sigusr1_handler, SIGUSR1);
-            size_t size = (i == n - 1) ? last_part_size : part_size;
-            off_t offset = i * part_size;
-            char *part_content = (char *)malloc(size);
-            if (part_content == NULL)
-                ERR("malloc");
-
-            memcpy(part_content, file_content + offset, size);
-            child_work(part_content, size, i, path);
-            free(part_content);
-            free(file_content);
-            exit(EXIT_SUCCESS); // Exit child process
-        }
-        child_pids[i] = pid;
+        long long start = now_ns();
+        if (create_worker(i) < 0)
+            ERR(create_names[create_method]);
+        long long elapsed = now_ns() - start;
+        total_ns += elapsed;
+        if (elapsed > max_ns)
+            max_ns = elapsed;
     }
 
-    free(file_content);
+    printf("Created %d workers with %s for a file of %lld bytes: %.1f us on average, %.1f us at most\n", n,
+           create_names[create_method], (long long)file_size, total_ns / 1000.0 / n, max_ns / 1000.0);
 }
 
+// Entry point of a worker started by spawn_worker
+int worker_main(char* argv[])
+{
+    int i = atoi(argv[2]);
+    off_t offset = atoll(argv[3]);
+    size_t size = strtoull(argv[4], NULL, 10);
+    int fd = atoi(argv[5]);
+    max_retries = atoi(argv[7]);
+    utf8 = atoi(argv[8]);
+    window = strtoull(argv[9], NULL, 10);
+    map_worker(fd, i, offset, size, argv[6]);
+    close(fd);
+    return EXIT_SUCCESS;
+}
 
-int main(int argc, char* argv[])
+long long parse_size(const char* arg)
 {
-    if (argc != 3)
+    char* end;
+    long long size = strtoll(arg, &end, 10);
+    switch (*end)
     {
-        usage(argc, argv);
+        case 'G':
+            size *= 1024; // fall through
+        case 'M':
+            size *= 1024; // fall through
+        case 'K':
+            size *= 1024;
+            end++;
     }
+    return end == arg || *end != '\0' ? -1 : size;
+}
 
-    char* path = argv[1];
-    int k = atoi(argv[2]);
+// Bytes this process has resident now, which every worker starts out with too
+long long resident_bytes()
+{
+    long long pages, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%lld %lld", &pages, &resident) != 2)
+        resident = 0;
+    fclose(f);
+    return resident * sysconf(_SC_PAGESIZE);
+}
 
-    if (k <= 0 || k >= 8)
+// Fits the job into budget bytes of resident memory: neither the parent nor the fork server
+// holds a copy of the file, and each of at most *k workers holds one window of its part
+void plan_memory(long long budget, off_t size, int* k)
+{
+    long long overhead = resident_bytes();
+    int helpers = create_method == CREATE_SERVER ? 2 : 1; // The parent, and the fork server
+    long long available = budget - helpers * overhead;
+    int n = *k;
+    if (available / (overhead + MIN_WINDOW) < n)
+        n = available / (overhead + MIN_WINDOW);
+    if (n < 1)
     {
-        usage(argc, argv);
+        fprintf(stderr, "A memory budget of %lld bytes is too small, %lld are needed at least\n", budget,
+                (helpers + 1) * overhead + MIN_WINDOW);
+        exit(EXIT_FAILURE);
     }
+    long long largest = size / n + size % n;
+    long long fits = available / n - overhead;
+    long long page = sysconf(_SC_PAGESIZE);
+    window = fits < largest ? fits / page * page : largest;
+    if (window == 0)
+        window = MIN_WINDOW; // An empty file, still read rather than copied
+    if (n < *k)
+        printf("Memory budget: %d workers instead of %d\n", n, *k);
+    printf("Memory budget of %lld KB: workers hold %zu bytes of their part at once, about %lld KB per process besides\n",
+           budget / 1024, window, overhead / 1024);
+    *k = n;
+}
 
-    child_pids = malloc(k * sizeof(pid_t));
+// Peak resident memory of this process in KB; unlike getrusage() it leaves out the memory
+// of the program that exec'd it (the shell)
+long peak_rss_kb()
+{
+    long peak = 0;
+    char line[256];
+    FILE* f = fopen("/proc/self/status", "r");
+    if (f == NULL)
+        return 0;
+    while (fgets(line, sizeof(line), f) != NULL)
+    {
+        if (sscanf(line, "VmHWM: %ld kB", &peak) == 1)
+            break;
+    }
+    fclose(f);
+    return peak;
+}
+
+// Peak resident memory of every process, whose sum bounds what was resident at once, against the budget
+void report_memory(FILE* out, long long budget)
+{
+    long parent = peak_rss_kb();
+    long total = parent, largest = 0;
+    for (int i = 0; i < pool.count; i++)
+    {
+        long rss = pool.children[i].usage.ru_maxrss;
+        total += rss;
+        if (rss > largest)
+            largest = rss;
+    }
+    fprintf(out, "Peak RSS: parent %ld KB, workers up to %ld KB each, %ld KB in all", parent, largest, total);
+    if (budget > 0)
+        fprintf(out, " of a %lld KB budget (%.0f%%)%s", budget / 1024, 100.0 * total * 1024 / budget,
+                total * 1024 > budget ? ", over it" : "");
+    fprintf(out, "\n");
+}
 
+// Processes the file in *k parts, one worker each, fewer if budget (bytes, 0: none) requires;
+// returns how many parts failed
+int process_file(const char* path, int* k, long long budget)
+{
     int fd = open(path, O_RDONLY);
     if (fd == -1)
         ERR("open");
+    struct stat st;
+    if (fstat(fd, &st) == -1)
+        ERR("fstat");
+    if (budget > 0)
+        plan_memory(budget, st.st_size, k);
+
+    // Blocked until the workers wait for it, inherited by them whichever way they are created
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGUSR1);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
 
     printf("Parent PID: %d\n", getpid());
-    create_children(fd, k, path);
+    if (create_method == CREATE_SERVER)
+        start_server(fd, path);
+    create_children(fd, *k, path);
 
+    long long start = trace_now();
     sleep(1);
+    trace_span("sleep", start, "requested_us", 1000000, NULL, 0);
 
-    for(int i = 0; i < k; i++)
+    for(int i = 0; i < *k; i++)
     {
-        kill(child_pids[i], SIGUSR1);
+        trace_kill(pool.children[i].pid, SIGUSR1);
     }
 
-    while (wait(NULL) > 0)
+    int failed = 0;
+    if (max_retries >= 0)
     {
-        ;
+        supervisor_t sup;
+        if (supervisor_init(&sup, &pool, *k, max_retries, retry_worker) == -1)
+            ERR("supervisor_init");
+        failed = supervise(&sup);
+        if (failed == -1)
+            ERR("supervise");
+        supervisor_free(&sup);
     }
-
-    free(child_pids);
+    else if (pool_wait_all(&pool) == -1)
+        ERR("pool_wait_all");
+    if (create_method == CREATE_SERVER)
+        stop_server(); // Only now, as it creates the replacements too
+    free(file_content);
+    free(part_start);
     close(fd);
-    printf("Parent quits\n");
+    return failed;
+}
+
+int main(int argc, char* argv[])
+{
+    if (argc == WORKER_ARGC && strcmp(argv[1], WORKER_ARG) == 0)
+        return worker_main(argv);
+
+    char* json_path = NULL;
+    char* trace_file = NULL;
+    int c;
+    long long rate = 0, burst = 0, budget = 0;
+    struct option long_options[] = { { "mem-budget", required_argument, NULL, 'm' }, { NULL, 0, NULL, 0 } };
+    while ((c = getopt_long(argc, argv, "j:e:pc:r:b:u", long_options, NULL)) != -1)
+    {
+        switch (c)
+        {
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'e':
+                trace_file = optarg;
+                break;
+            case 'p':
+                perf_samples = MAP_FAILED; // Mapped once k is known
+                break;
+            case 'c':
+                for (create_method = 0; create_method <= CREATE_SERVER; create_method++)
+                {
+                    if (strcmp(optarg, create_names[create_method]) == 0)
+                        break;
+                }
+                if (create_method > CREATE_SERVER)
+                    usage(argc, argv);
+                break;
+            case 'r':
+                max_retries = atoi(optarg);
+                if (max_retries < 0)
+                    usage(argc, argv);
+                break;
+            case 'b':
+                if (throttle_parse(optarg, &rate, &burst) == -1)
+                    usage(argc, argv);
+                break;
+            case 'u':
+                utf8 = 1;
+                break;
+            case 'm':
+                budget = parse_size(optarg);
+                if (budget <= 0)
+                    usage(argc, argv);
+                break;
+            default:
+                usage(argc, argv);
+        }
+    }
+    if (argc - optind != 2)
+    {
+        usage(argc, argv);
+    }
+
+    char* path = argv[optind];
+    int k = atoi(argv[optind + 1]);
+
+    // Spawned workers cannot share the bucket, a rate they would ignore is refused
+    if (k <= 0 || k >= 8 || (create_method == CREATE_SPAWN && rate > 0) ||
+        (strcmp(path, "-") == 0 && (perf_samples != NULL || create_method != CREATE_FORK || max_retries >= 0 || rate > 0 || budget > 0)))
+    {
+        usage(argc, argv);
+    }
+
+    if (perf_samples != NULL)
+    {
+        perf_samples = mmap(NULL, k * sizeof(perf_sample_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (perf_samples == MAP_FAILED)
+            ERR("mmap");
+        for (int i = 0; i < k; i++)
+        {
+            for (int j = 0; j < PERF_COUNTERS; j++)
+                perf_samples[i].value[j] = -1; // Stays so for a child that never reports
+        }
+    }
+    if (trace_file != NULL && trace_init(trace_file) == -1)
+        ERR("trace_init");
+    if (rate > 0 && (throttle = throttle_init(rate, burst)) == NULL)
+        ERR("throttle_init");
+    if (pool_init(&pool, k) == -1)
+        ERR("pool_init");
+
+    FILE* report = stdout;
+    int failed = 0;
+    if (strcmp(path, "-") == 0)
+    {
+        report = stderr; // stdout carries the data
+        if (stream_run(&pool, STDIN_FILENO, STDOUT_FILENO, k, alternate_block, utf8 ? utf8_complete : NULL) == -1)
+            ERR("stream_run");
+    }
+    else
+        failed = process_file(path, &k, budget);
+    pool_print_usage(report, pool.children, pool.count, pool.count);
+    report_memory(report, budget);
+    if (perf_samples != NULL)
+    {
+        perf_print(report, perf_samples, k);
+        munmap(perf_samples, k * sizeof(perf_sample_t));
+    }
+    if (json_path != NULL && pool_write_usage_json(json_path, pool.children, pool.count) == -1)
+        ERR("pool_write_usage_json");
+
+    pool_free(&pool);
+    if (throttle != NULL)
+        throttle_free(throttle);
+    if (trace_close() == -1)
+        ERR("trace_close");
+    if (failed > 0)
+    {
+        fprintf(report, "Parent quits, %d of %d parts failed\n", failed, k);
+        return EXIT_FAILURE;
+    }
+    fprintf(report, "Parent quits\n");
     return EXIT_SUCCESS;
 }
\ No newline at end of file